@@ -0,0 +1,9 @@
+//go:build !linux
+
+package main
+
+import "errors"
+
+func setAffinity(cpu int) error {
+	return errors.New("CPU affinity is not supported on this platform")
+}
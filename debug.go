@@ -0,0 +1,66 @@
+package main
+
+import (
+	"fmt"
+	"log/slog"
+	"net/http"
+	"time"
+)
+
+const DefaultDebugAddr = "127.0.0.1:6060"
+
+// serveDebug runs the operator endpoint on its own listener, away from the
+// media port:
+//
+//	/debug/trace?stream_id=ID  trace every packet of stream ID, empty stops
+//	/debug/log-level?level=L   change the minimum log level
+//	/debug/locks               stream registry lock contention
+func (server *Server) serveDebug(addr string) {
+	mux := http.NewServeMux()
+	mux.HandleFunc("/debug/trace", server.handleTrace)
+	mux.HandleFunc("/debug/log-level", server.handleLogLevel)
+	mux.HandleFunc("/debug/locks", server.handleLocks)
+
+	slog.Info("Debug endpoint listening", "addr", addr)
+	if err := http.ListenAndServe(addr, mux); err != nil {
+		slog.Error("Debug endpoint stopped", "addr", addr, "err", err)
+	}
+}
+
+func (server *Server) handleTrace(w http.ResponseWriter, r *http.Request) {
+	streamID := r.URL.Query().Get("stream_id")
+	server.SetTrace(streamID)
+	slog.Info("Packet tracing changed", "stream_id", streamID)
+	fmt.Fprintf(w, "tracing %q\n", streamID)
+}
+
+func (server *Server) handleLogLevel(w http.ResponseWriter, r *http.Request) {
+	if level := r.URL.Query().Get("level"); level != "" {
+		if err := server.LogLevel.UnmarshalText([]byte(level)); err != nil {
+			http.Error(w, err.Error(), http.StatusBadRequest)
+			return
+		}
+	}
+	fmt.Fprintf(w, "%s\n", server.LogLevel.Level())
+}
+
+func (server *Server) handleLocks(w http.ResponseWriter, r *http.Request) {
+	s := server.Streams.LockStats()
+	fmt.Fprintf(w, "registry acquired=%d contended=%d wait=%s hold=%s max_hold=%s\n",
+		s.Acquired, s.Contended, time.Duration(s.WaitNanos), time.Duration(s.HoldNanos), time.Duration(s.MaxHoldNanos))
+}
+
+// SetTrace selects the one stream whose packets are logged at LevelTrace; an
+// empty streamID turns tracing off.
+func (server *Server) SetTrace(streamID string) {
+	if streamID == "" {
+		server.trace.Store(nil)
+		return
+	}
+	server.trace.Store(&streamID)
+}
+
+func (server *Server) tracing(streamID string) bool {
+	id := server.trace.Load()
+	return id != nil && *id == streamID
+}
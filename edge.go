@@ -0,0 +1,158 @@
+package main
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"log/slog"
+	"net"
+	"time"
+)
+
+const (
+	OriginDialTimeout = 5 * time.Second
+	OriginWaitTimeout = 10 * time.Second
+)
+
+// upstream is an edge's pull connection to the origin for one stream. ready
+// is closed once the origin has answered, err telling whether it failed.
+type upstream struct {
+	ready chan struct{}
+	err   error
+}
+
+// originStream returns the state of stream id on an edge, with a reference for
+// the caller, starting its upstream if none is running and waiting for the
+// origin's answer. An upstream lives until the origin hangs up or the stream
+// has had no viewers for the idle timeout; the next viewer then starts a new
+// one.
+func (server *Server) originStream(id string) (*State, error) {
+	server.upstreamsMu.Lock()
+	up := server.upstreams[id]
+	if up == nil {
+		up = &upstream{ready: make(chan struct{})}
+		server.upstreams[id] = up
+		go server.relay(id, up)
+	}
+	server.upstreamsMu.Unlock()
+
+	select {
+	case <-up.ready:
+	case <-time.After(OriginWaitTimeout):
+		return nil, fmt.Errorf("origin did not answer for stream %q", id)
+	}
+	if up.err != nil {
+		return nil, up.err
+	}
+	return server.Streams.Acquire(id), nil
+}
+
+// relay pulls stream id from the origin and ingests it locally as if it was
+// pushed to this relay, without recording it.
+func (server *Server) relay(id string, up *upstream) {
+	var session *PushSession
+	defer func() {
+		server.upstreamsMu.Lock()
+		delete(server.upstreams, id)
+		server.upstreamsMu.Unlock()
+		if session != nil {
+			session.Close()
+		}
+	}()
+
+	conn, resp, err := dialOrigin(server.Origin, id)
+	if err == nil {
+		defer conn.Close()
+		resp.Mode = "push"
+		session, err = server.openPush(resp, false, func() { interruptRead(conn) })
+	}
+	up.err = err
+	close(up.ready)
+	if err != nil {
+		slog.Warn("Cannot pull stream from origin", "stream_id", id, "origin", server.Origin, "err", err)
+		return
+	}
+
+	slog.Info("Pulling stream from origin", "stream_id", id, "origin", server.Origin)
+	stop := make(chan struct{})
+	defer close(stop)
+	go server.dropWhenUnwatched(session.State, conn, stop)
+	session.ReadPackets(conn)
+	slog.Info("Origin stream ended", "stream_id", id, "origin", server.Origin)
+}
+
+// dropWhenUnwatched closes an upstream connection once its stream has had no
+// viewers for a whole idle timeout, so that the stream can be freed.
+func (server *Server) dropWhenUnwatched(state *State, conn net.Conn, stop <-chan struct{}) {
+	if server.IdleTimeout <= 0 {
+		return
+	}
+	ticker := time.NewTicker(server.IdleTimeout / 2)
+	defer ticker.Stop()
+	idleTicks := 0
+	for {
+		select {
+		case <-stop:
+			return
+		case <-ticker.C:
+		}
+		if state.viewers() > 0 {
+			idleTicks = 0
+		} else if idleTicks++; idleTicks > 2 {
+			slog.Info("Dropping unwatched upstream", "stream_id", state.ID, "origin", server.Origin)
+			conn.Close()
+			return
+		}
+	}
+}
+
+// dialOrigin connects to the origin as a pull client of stream id and returns
+// the connection, positioned at the first packet, and the origin's response.
+func dialOrigin(origin, id string) (net.Conn, *Handshake, error) {
+	conn, err := net.DialTimeout("tcp", origin, OriginDialTimeout)
+	if err != nil {
+		return nil, nil, err
+	}
+
+	resp, err := pullHandshake(conn, id)
+	if err != nil {
+		conn.Close()
+		return nil, nil, err
+	}
+	return conn, resp, nil
+}
+
+func pullHandshake(conn net.Conn, id string) (*Handshake, error) {
+	conn.SetDeadline(time.Now().Add(OriginWaitTimeout))
+	defer conn.SetDeadline(time.Time{})
+
+	request, err := (&Handshake{Mode: "pull", StreamID: id, Binary: true}).Encode()
+	if err != nil {
+		return nil, err
+	}
+	if _, err := conn.Write(request); err != nil {
+		return nil, err
+	}
+
+	prefix := make([]byte, 8)
+	if _, err := io.ReadFull(conn, prefix[:4]); err != nil {
+		return nil, fmt.Errorf("origin has no stream %q: %w", id, err)
+	}
+	if binary.LittleEndian.Uint32(prefix) != HandshakeMagic {
+		return nil, errors.New("origin does not speak the binary handshake")
+	}
+	if _, err := io.ReadFull(conn, prefix[4:]); err != nil {
+		return nil, err
+	}
+	_, length, _, err := handshakeFrame(prefix)
+	if err != nil {
+		return nil, err
+	}
+
+	payload := make([]byte, length)
+	if _, err := io.ReadFull(conn, payload); err != nil {
+		return nil, err
+	}
+	return decodeBinaryHandshake(payload)
+}
@@ -0,0 +1,102 @@
+package main
+
+import (
+	"log/slog"
+	"runtime"
+	"sync/atomic"
+)
+
+const ShardQueueLen = 1024
+
+// fanoutShard is one slice of a stream's viewers and, except for the first
+// shard, which the publisher serves itself, the queue of its worker. A worker
+// and its queue are only created when the shard gets its first viewer, so a
+// stream with few viewers costs no more than the shards it uses.
+type fanoutShard struct {
+	// Clients is an immutable snapshot of the shard's viewers. The shard's
+	// goroutine iterates it without locking; joins and leaves copy it and
+	// store a new one while holding the stream's Mu.
+	Clients atomic.Pointer[[]subscriber]
+
+	// queue is set, under the stream's Mu, when the shard's worker starts
+	queue chan *Packet
+}
+
+func newFanoutShard() *fanoutShard {
+	shard := &fanoutShard{}
+	shard.Clients.Store(&[]subscriber{})
+	return shard
+}
+
+// startWorker starts the worker of shard i of state unless it is running or
+// i is the publisher's own shard. It must be called with Mu held.
+func (server *Server) startWorker(state *State, i int) {
+	shard := state.shards[i]
+	if i == 0 || shard.queue != nil {
+		return
+	}
+	shard.queue = make(chan *Packet, ShardQueueLen)
+	state.workers = append(state.workers, shard)
+	go server.fanoutWorker(state, i)
+}
+
+// fanout queues pkt on every viewer of the shard that joined before it was
+// published.
+func (shard *fanoutShard) fanout(pkt *Packet) {
+	subs := *shard.Clients.Load()
+	for i := range subs {
+		sub := &subs[i]
+		if pkt.Seq < sub.startSeq {
+			continue
+		}
+		if pkt.resync {
+			sub.Client.FoundKeyFrame = false
+		}
+		sub.enqueue(pkt)
+	}
+}
+
+// fanoutWorker serves shard i of state until the publisher closes its queue.
+func (server *Server) fanoutWorker(state *State, i int) {
+	if server.PinCPUs {
+		pinThread(state.ID, i)
+	}
+
+	shard := state.shards[i]
+	for pkt := range shard.queue {
+		shard.fanout(pkt)
+		pkt.Release()
+	}
+}
+
+// leastLoadedShard returns the shard with the fewest viewers, preferring the
+// publisher's own. It must be called with Mu held.
+func (state *State) leastLoadedShard() int {
+	best, fewest := 0, len(*state.shards[0].Clients.Load())
+	for i := 1; i < len(state.shards) && fewest > 0; i++ {
+		if n := len(*state.shards[i].Clients.Load()); n < fewest {
+			best, fewest = i, n
+		}
+	}
+	return best
+}
+
+// viewers counts the viewers of every shard.
+func (state *State) viewers() int {
+	n := 0
+	for _, shard := range state.shards {
+		n += len(*shard.Clients.Load())
+	}
+	return n
+}
+
+// pinThread locks the calling goroutine to its OS thread and binds that thread
+// to a CPU chosen from the stream ID and the shard index, so the shards of a
+// stream land on neighbouring CPUs and different streams spread out.
+func pinThread(streamID string, shard int) {
+	runtime.LockOSThread()
+	cpu := int((hashStreamID(streamID) + uint32(shard)) % uint32(runtime.NumCPU()))
+	if err := setAffinity(cpu); err != nil {
+		slog.Warn("Cannot pin fan-out thread", "stream_id", streamID, "shard", shard, "cpu", cpu, "err", err)
+	}
+}
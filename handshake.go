@@ -0,0 +1,265 @@
+package main
+
+import (
+	"encoding/base64"
+	"encoding/binary"
+	"encoding/json"
+	"errors"
+	"fmt"
+)
+
+// A binary handshake starts with HandshakeMagic where a JSON handshake has its
+// 4-byte length. The magic is larger than MaxHandshakeSize, so the two cannot
+// be confused. It is followed by the little-endian length of the body and the
+// body itself:
+//
+//	version  u8   HandshakeVersion
+//	mode     u8   0 pull response, 1 push, 2 pull
+//	reserved u16
+//	video_codec_id, audio_codec_id, fps, width, height  u32 each
+//	TLVs     type u16, length u32, value
+//
+// The stream ID and the extradata travel as raw TLV values. Unknown TLV types
+// are skipped. A relay answers a binary pull handshake with a binary response.
+const (
+	HandshakeMagic      = 0x42554653 // "SFUB"
+	HandshakeVersion    = 1
+	handshakeFixedSize  = 24
+	handshakeTLVHdrSize = 6
+)
+
+const (
+	tlvStreamID   = 1
+	tlvVideoExtra = 2
+	tlvAudioExtra = 3
+)
+
+var handshakeModes = [...]string{"", "push", "pull"}
+
+// Handshake is a decoded push or pull handshake, or a pull response when Mode
+// is empty. Binary records which encoding the peer used, so that replies can
+// use the same one.
+type Handshake struct {
+	Mode         string
+	StreamID     string
+	VideoCodecID int
+	AudioCodecID int
+	FPS          int
+	Width        int
+	Height       int
+	VideoExtra   []byte
+	AudioExtra   []byte
+	Binary       bool
+}
+
+// handshakeFrame inspects the start of a connection. It returns the size of
+// the prefix before the handshake body, the size of the body and whether it
+// is binary, or n == 0 if more bytes are needed to tell.
+func handshakeFrame(in []byte) (n int, length uint32, binaryFrame bool, err error) {
+	if len(in) < 4 {
+		return 0, 0, false, nil
+	}
+
+	n = 4
+	length = binary.LittleEndian.Uint32(in)
+	if length == HandshakeMagic {
+		if len(in) < 8 {
+			return 0, 0, false, nil
+		}
+		n = 8
+		length = binary.LittleEndian.Uint32(in[4:])
+		binaryFrame = true
+	}
+
+	if length > MaxHandshakeSize {
+		return 0, 0, false, fmt.Errorf("handshake too large: %d bytes", length)
+	}
+	return n, length, binaryFrame, nil
+}
+
+// parseHandshake decodes a handshake body in either encoding.
+func parseHandshake(payload []byte, binaryFrame bool) (*Handshake, error) {
+	if binaryFrame {
+		return decodeBinaryHandshake(payload)
+	}
+	return decodeJSONHandshake(payload)
+}
+
+func decodeJSONHandshake(payload []byte) (*Handshake, error) {
+	var header map[string]any
+	if err := json.Unmarshal(payload, &header); err != nil {
+		return nil, fmt.Errorf("invalid JSON header: %w", err)
+	}
+
+	h := &Handshake{}
+	var ok bool
+	if h.Mode, ok = header["mode"].(string); !ok {
+		return nil, errors.New("missing mode")
+	}
+	if h.StreamID, ok = header["stream_id"].(string); !ok {
+		return nil, errors.New("missing stream_id")
+	}
+	if h.Mode != "push" {
+		return h, nil
+	}
+
+	for _, field := range []struct {
+		name string
+		dst  *int
+	}{
+		{"video_codec_id", &h.VideoCodecID},
+		{"audio_codec_id", &h.AudioCodecID},
+		{"fps", &h.FPS},
+		{"width", &h.Width},
+		{"height", &h.Height},
+	} {
+		value, ok := header[field.name].(float64)
+		if !ok {
+			return nil, fmt.Errorf("missing %s", field.name)
+		}
+		*field.dst = int(value)
+	}
+
+	for _, field := range []struct {
+		name string
+		dst  *[]byte
+	}{
+		{"video_extradata", &h.VideoExtra},
+		{"audio_extradata", &h.AudioExtra},
+	} {
+		if encoded, ok := header[field.name].(string); ok && encoded != "" {
+			var err error
+			if *field.dst, err = base64.StdEncoding.DecodeString(encoded); err != nil {
+				return nil, fmt.Errorf("cannot decode %s: %w", field.name, err)
+			}
+		}
+	}
+	return h, nil
+}
+
+func decodeBinaryHandshake(payload []byte) (*Handshake, error) {
+	if len(payload) < handshakeFixedSize {
+		return nil, fmt.Errorf("binary handshake too short: %d bytes", len(payload))
+	}
+	if version := payload[0]; version != HandshakeVersion {
+		return nil, fmt.Errorf("unsupported handshake version %d", version)
+	}
+	if int(payload[1]) >= len(handshakeModes) {
+		return nil, fmt.Errorf("unknown handshake mode %d", payload[1])
+	}
+
+	h := &Handshake{
+		Mode:         handshakeModes[payload[1]],
+		VideoCodecID: int(binary.LittleEndian.Uint32(payload[4:])),
+		AudioCodecID: int(binary.LittleEndian.Uint32(payload[8:])),
+		FPS:          int(binary.LittleEndian.Uint32(payload[12:])),
+		Width:        int(binary.LittleEndian.Uint32(payload[16:])),
+		Height:       int(binary.LittleEndian.Uint32(payload[20:])),
+		Binary:       true,
+	}
+
+	hasStreamID := false
+	for tlvs := payload[handshakeFixedSize:]; len(tlvs) > 0; {
+		if len(tlvs) < handshakeTLVHdrSize {
+			return nil, errors.New("truncated handshake TLV")
+		}
+		typ := binary.LittleEndian.Uint16(tlvs)
+		length := binary.LittleEndian.Uint32(tlvs[2:])
+		tlvs = tlvs[handshakeTLVHdrSize:]
+		if uint64(length) > uint64(len(tlvs)) {
+			return nil, errors.New("truncated handshake TLV")
+		}
+		value := tlvs[:length:length]
+		tlvs = tlvs[length:]
+
+		switch typ {
+		case tlvStreamID:
+			h.StreamID = string(value)
+			hasStreamID = true
+		case tlvVideoExtra:
+			h.VideoExtra = value
+		case tlvAudioExtra:
+			h.AudioExtra = value
+		}
+	}
+
+	if !hasStreamID {
+		return nil, errors.New("missing stream_id")
+	}
+	return h, nil
+}
+
+// Encode returns h framed for the wire in the encoding given by h.Binary.
+func (h *Handshake) Encode() ([]byte, error) {
+	if h.Binary {
+		return h.encodeBinary(), nil
+	}
+
+	header := map[string]any{
+		"stream_id":      h.StreamID,
+		"video_codec_id": h.VideoCodecID,
+		"audio_codec_id": h.AudioCodecID,
+		"fps":            h.FPS,
+		"height":         h.Height,
+		"width":          h.Width,
+	}
+	if h.Mode != "" {
+		header["mode"] = h.Mode
+	}
+	if len(h.VideoExtra) > 0 {
+		header["video_extradata"] = base64.StdEncoding.EncodeToString(h.VideoExtra)
+	}
+	if len(h.AudioExtra) > 0 {
+		header["audio_extradata"] = base64.StdEncoding.EncodeToString(h.AudioExtra)
+	}
+
+	data, err := json.Marshal(header)
+	if err != nil {
+		return nil, err
+	}
+	framed := make([]byte, 4+len(data))
+	binary.LittleEndian.PutUint32(framed, uint32(len(data)))
+	copy(framed[4:], data)
+	return framed, nil
+}
+
+func (h *Handshake) encodeBinary() []byte {
+	tlvs := [...]struct {
+		typ   uint16
+		value []byte
+	}{
+		{tlvStreamID, []byte(h.StreamID)},
+		{tlvVideoExtra, h.VideoExtra},
+		{tlvAudioExtra, h.AudioExtra},
+	}
+
+	size := handshakeFixedSize
+	for _, tlv := range tlvs {
+		if len(tlv.value) > 0 || tlv.typ == tlvStreamID {
+			size += handshakeTLVHdrSize + len(tlv.value)
+		}
+	}
+
+	b := make([]byte, 8, 8+size)
+	binary.LittleEndian.PutUint32(b, HandshakeMagic)
+	binary.LittleEndian.PutUint32(b[4:], uint32(size))
+
+	var mode byte
+	for i, name := range handshakeModes {
+		if name == h.Mode {
+			mode = byte(i)
+		}
+	}
+	b = append(b, HandshakeVersion, mode, 0, 0)
+	for _, v := range []int{h.VideoCodecID, h.AudioCodecID, h.FPS, h.Width, h.Height} {
+		b = binary.LittleEndian.AppendUint32(b, uint32(v))
+	}
+	for _, tlv := range tlvs {
+		if len(tlv.value) > 0 || tlv.typ == tlvStreamID {
+			b = binary.LittleEndian.AppendUint16(b, tlv.typ)
+			b = binary.LittleEndian.AppendUint32(b, uint32(len(tlv.value)))
+			b = append(b, tlv.value...)
+		}
+	}
+	return b
+}
@@ -0,0 +1,155 @@
+package main
+
+import (
+	"bytes"
+	"encoding/binary"
+	"strings"
+	"testing"
+)
+
+// binaryBody builds a binary handshake body with the given version and mode
+// and appends tlvs, which are already encoded.
+func binaryBody(version, mode byte, tlvs ...[]byte) []byte {
+	b := []byte{version, mode, 0, 0}
+	for _, v := range []uint32{27, 86018, 30, 1280, 720} {
+		b = binary.LittleEndian.AppendUint32(b, v)
+	}
+	for _, tlv := range tlvs {
+		b = append(b, tlv...)
+	}
+	return b
+}
+
+// tlv encodes one TLV whose length field says length, which may disagree with
+// len(value) to build truncated or oversized TLVs.
+func tlv(typ uint16, length uint32, value string) []byte {
+	b := binary.LittleEndian.AppendUint16(nil, typ)
+	b = binary.LittleEndian.AppendUint32(b, length)
+	return append(b, value...)
+}
+
+func TestHandshakeRoundTrip(t *testing.T) {
+	for _, h := range []Handshake{
+		{Mode: "push", StreamID: "cam", VideoCodecID: 27, AudioCodecID: 86018, FPS: 30, Width: 1280, Height: 720, VideoExtra: []byte{0, 0, 0, 1, 0x67}, AudioExtra: []byte{0x12, 0x10}},
+		{Mode: "push", StreamID: "no-extradata", VideoCodecID: 27, FPS: 25, Width: 640, Height: 360},
+		{Mode: "pull", StreamID: "cam"},
+		{Mode: "pull", StreamID: ""},
+		{StreamID: "response", VideoCodecID: 27, AudioCodecID: 86018, FPS: 30, Width: 1920, Height: 1080, VideoExtra: bytes.Repeat([]byte{0xab}, 70000)},
+	} {
+		for _, binaryFrame := range []bool{false, true} {
+			if !binaryFrame && h.Mode == "" {
+				// edges ask for binary pull responses; the relay never
+				// parses a JSON one
+				continue
+			}
+			h := h
+			h.Binary = binaryFrame
+			framed, err := h.Encode()
+			if err != nil {
+				t.Fatalf("%+v: Encode: %v", h, err)
+			}
+
+			n, length, gotBinary, err := handshakeFrame(framed)
+			if err != nil || n == 0 || gotBinary != binaryFrame || int(length) != len(framed)-n {
+				t.Fatalf("%s binary=%v: handshakeFrame = %d, %d, %v, %v for %d bytes", h.StreamID, binaryFrame, n, length, gotBinary, err, len(framed))
+			}
+			got, err := parseHandshake(framed[n:], gotBinary)
+			if err != nil {
+				t.Fatalf("%s binary=%v: parseHandshake: %v", h.StreamID, binaryFrame, err)
+			}
+
+			want := h
+			if !binaryFrame && h.Mode == "pull" {
+				// a JSON pull handshake carries only the mode and the stream
+				want = Handshake{Mode: "pull", StreamID: h.StreamID}
+			}
+			if got.Mode != want.Mode || got.StreamID != want.StreamID || got.VideoCodecID != want.VideoCodecID ||
+				got.AudioCodecID != want.AudioCodecID || got.FPS != want.FPS || got.Width != want.Width || got.Height != want.Height ||
+				!bytes.Equal(got.VideoExtra, want.VideoExtra) || !bytes.Equal(got.AudioExtra, want.AudioExtra) || got.Binary != binaryFrame {
+				t.Errorf("binary=%v: got %+v, want %+v", binaryFrame, got, want)
+			}
+		}
+	}
+}
+
+func TestHandshakeFrame(t *testing.T) {
+	le := binary.LittleEndian
+	magic := le.AppendUint32(nil, HandshakeMagic)
+	for _, tc := range []struct {
+		name    string
+		in      []byte
+		n       int
+		length  uint32
+		binary  bool
+		wantErr bool
+	}{
+		{"empty", nil, 0, 0, false, false},
+		{"partial JSON length", []byte{10, 0, 0}, 0, 0, false, false},
+		{"JSON", le.AppendUint32(nil, 100), 4, 100, false, false},
+		{"JSON at the limit", le.AppendUint32(nil, MaxHandshakeSize), 4, MaxHandshakeSize, false, false},
+		{"JSON oversized", le.AppendUint32(nil, MaxHandshakeSize+1), 0, 0, false, true},
+		{"magic without length", magic, 0, 0, false, false},
+		{"magic with partial length", append(magic[:4:4], 1, 0), 0, 0, false, false},
+		{"binary", le.AppendUint32(magic[:4:4], 42), 8, 42, true, false},
+		{"binary oversized", le.AppendUint32(magic[:4:4], MaxHandshakeSize+1), 0, 0, false, true},
+		{"binary length overflowing", le.AppendUint32(magic[:4:4], 0xffffffff), 0, 0, false, true},
+	} {
+		n, length, binaryFrame, err := handshakeFrame(tc.in)
+		if (err != nil) != tc.wantErr || n != tc.n || length != tc.length || binaryFrame != tc.binary {
+			t.Errorf("%s: got %d, %d, %v, %v; want %d, %d, %v, error %v", tc.name, n, length, binaryFrame, err, tc.n, tc.length, tc.binary, tc.wantErr)
+		}
+	}
+}
+
+func TestDecodeBinaryHandshake(t *testing.T) {
+	for _, tc := range []struct {
+		name     string
+		body     []byte
+		err      string
+		streamID string
+		video    string
+	}{
+		{name: "stream only", body: binaryBody(1, 2, tlv(tlvStreamID, 3, "cam")), streamID: "cam"},
+		{name: "empty stream ID", body: binaryBody(1, 2, tlv(tlvStreamID, 0, "")), streamID: ""},
+		{name: "extradata", body: binaryBody(1, 1, tlv(tlvVideoExtra, 2, "\x00\x01"), tlv(tlvStreamID, 1, "s")), streamID: "s", video: "\x00\x01"},
+		{name: "unknown TLV skipped", body: binaryBody(1, 1, tlv(99, 4, "skip"), tlv(tlvStreamID, 1, "s")), streamID: "s"},
+		{name: "last stream ID wins", body: binaryBody(1, 2, tlv(tlvStreamID, 1, "a"), tlv(tlvStreamID, 1, "b")), streamID: "b"},
+		{name: "pull response", body: binaryBody(1, 0, tlv(tlvStreamID, 1, "s")), streamID: "s"},
+
+		{name: "too short", body: binaryBody(1, 2)[:handshakeFixedSize-1], err: "too short"},
+		{name: "bad version", body: binaryBody(2, 2, tlv(tlvStreamID, 1, "s")), err: "version"},
+		{name: "bad mode", body: binaryBody(1, 3, tlv(tlvStreamID, 1, "s")), err: "mode"},
+		{name: "no stream ID", body: binaryBody(1, 2), err: "missing stream_id"},
+		{name: "truncated TLV header", body: binaryBody(1, 2, tlv(tlvStreamID, 1, "s"), []byte{1, 0, 0}), err: "truncated"},
+		{name: "TLV value past the end", body: binaryBody(1, 2, tlv(tlvStreamID, 4, "abc")), err: "truncated"},
+		{name: "TLV length oversized", body: binaryBody(1, 2, tlv(tlvVideoExtra, 0xffffffff, "x"), tlv(tlvStreamID, 1, "s")), err: "truncated"},
+	} {
+		h, err := decodeBinaryHandshake(tc.body)
+		if tc.err != "" {
+			if err == nil || !strings.Contains(err.Error(), tc.err) {
+				t.Errorf("%s: got %+v, %v; want error containing %q", tc.name, h, err, tc.err)
+			}
+			continue
+		}
+		if err != nil {
+			t.Errorf("%s: %v", tc.name, err)
+			continue
+		}
+		if h.StreamID != tc.streamID || string(h.VideoExtra) != tc.video || h.FPS != 30 || h.Width != 1280 || h.Height != 720 || !h.Binary {
+			t.Errorf("%s: got %+v", tc.name, h)
+		}
+	}
+}
+
+func TestDecodeBinaryHandshakeExtradataIsBounded(t *testing.T) {
+	// appending to the extradata must not overwrite the TLV after it
+	body := binaryBody(1, 1, tlv(tlvVideoExtra, 2, "ab"), tlv(tlvStreamID, 3, "cam"))
+	h, err := decodeBinaryHandshake(body)
+	if err != nil {
+		t.Fatal(err)
+	}
+	_ = append(h.VideoExtra, 'X')
+	if h, err := decodeBinaryHandshake(body); err != nil || h.StreamID != "cam" {
+		t.Errorf("after append: got %+v, %v", h, err)
+	}
+}
@@ -0,0 +1,185 @@
+package main
+
+import (
+	"fmt"
+	"sync"
+	"sync/atomic"
+)
+
+// A publisher's connection is read in bulk into chunks of IngestChunkSize
+// bytes, and every packet that fits in a chunk is handed out as a slice of it
+// instead of being copied into a buffer of its own. Payloads larger than
+// IngestMaxChunkedSize are read straight into a pooled packet instead, so a
+// big keyframe does not force a chunk switch for the sake of one packet.
+const (
+	IngestChunkSize      = 256 << 10
+	IngestMaxChunkedSize = IngestChunkSize / 4
+	IngestMinRead        = 4 << 10
+)
+
+// chunk is a reference-counted read buffer. The ingest buffer filling it
+// holds one reference and every packet whose payload points into it holds
+// another; the last Release returns it to the pool.
+type chunk struct {
+	buf  []byte
+	refs atomic.Int32
+}
+
+var (
+	chunkPool = sync.Pool{New: func() any {
+		return &chunk{buf: make([]byte, IngestChunkSize)}
+	}}
+
+	// chunkPacketPool holds packets without a payload buffer of their own,
+	// for payloads that live in a chunk.
+	chunkPacketPool sync.Pool
+)
+
+func newChunk() *chunk {
+	c := chunkPool.Get().(*chunk)
+	c.refs.Store(1)
+	return c
+}
+
+func (c *chunk) Release() {
+	refs := c.refs.Add(-1)
+	if refs > 0 {
+		return
+	}
+	if refs < 0 {
+		panic("sfu: chunk released more times than retained")
+	}
+	chunkPool.Put(c)
+}
+
+// newChunkPacket returns a packet with one reference whose header is frame's
+// first HeaderSize bytes and whose payload is the rest of frame, inside c.
+func newChunkPacket(h Header, c *chunk, frame []byte) *Packet {
+	var pkt *Packet
+	if v := chunkPacketPool.Get(); v != nil {
+		pkt = v.(*Packet)
+	} else {
+		pkt = &Packet{class: -1}
+	}
+
+	c.refs.Add(1)
+	pkt.Header = h
+	copy(pkt.Head[:], frame)
+	pkt.Payload = frame[HeaderSize:len(frame):len(frame)]
+	pkt.chunk = c
+	pkt.resync = false
+	pkt.restart = false
+	pkt.refs.Store(1)
+	return pkt
+}
+
+// ingestBuffer splits the byte stream of a push connection into packets. The
+// caller reads into space and reports how much it read with commit, so one
+// read can deliver many small packets.
+type ingestBuffer struct {
+	chunk *chunk
+	// r is the start of the first incomplete frame in chunk, w the end of
+	// the bytes read into it.
+	r, w int
+
+	// pkt is a packet too large for a chunk whose payload is read directly
+	// into it; filled bytes of it have arrived.
+	pkt    *Packet
+	filled int
+}
+
+// space returns the buffer the next read should fill.
+func (b *ingestBuffer) space() []byte {
+	if b.pkt != nil {
+		return b.pkt.Payload[b.filled:]
+	}
+
+	if b.chunk != nil && b.r == b.w && b.chunk.refs.Load() == 1 {
+		// no packet points into the chunk any more, start over
+		b.r, b.w = 0, 0
+	}
+
+	if b.chunk == nil || len(b.chunk.buf)-b.w < IngestMinRead || b.r+b.pending() > len(b.chunk.buf) {
+		// move the incomplete frame to the start of a fresh chunk
+		next := newChunk()
+		if b.chunk != nil {
+			b.w = copy(next.buf, b.chunk.buf[b.r:b.w])
+			b.r = 0
+			b.chunk.Release()
+		}
+		b.chunk = next
+	}
+	return b.chunk.buf[b.w:]
+}
+
+// pending returns how many bytes the first incomplete frame needs, as far as
+// is known: its header, or its header and payload once the header is in.
+func (b *ingestBuffer) pending() int {
+	if b.w-b.r < HeaderSize {
+		return HeaderSize
+	}
+	h := DecodeHeader(b.chunk.buf[b.r:])
+	return HeaderSize + int(h.Size)
+}
+
+// commit accounts for n bytes read into space and ingests every packet they
+// complete.
+func (b *ingestBuffer) commit(n int, session *PushSession) error {
+	if b.pkt != nil {
+		b.filled += n
+		if b.filled == len(b.pkt.Payload) {
+			session.Ingest(b.pkt)
+			b.pkt = nil
+		}
+		return nil
+	}
+
+	b.w += n
+	for b.w-b.r >= HeaderSize {
+		buf := b.chunk.buf[b.r:b.w]
+		h := DecodeHeader(buf)
+		if h.Size < 0 || h.Size > MaxPacketSize {
+			return fmt.Errorf("invalid packet size %d", h.Size)
+		}
+
+		size := HeaderSize + int(h.Size)
+		if size <= len(buf) {
+			session.Ingest(newChunkPacket(h, b.chunk, buf[:size]))
+			b.r += size
+			continue
+		}
+
+		if h.Size > IngestMaxChunkedSize {
+			b.pkt = NewPacket(h)
+			b.filled = copy(b.pkt.Payload, buf[HeaderSize:])
+			b.r = b.w
+		}
+		break
+	}
+	return nil
+}
+
+// write copies data into the buffer as if it had been read; it takes bytes
+// that arrived before the connection switched to pushing.
+func (b *ingestBuffer) write(data []byte, session *PushSession) error {
+	for len(data) > 0 {
+		k := copy(b.space(), data)
+		data = data[k:]
+		if err := b.commit(k, session); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// Close releases the buffer's chunk and any partly read packet.
+func (b *ingestBuffer) Close() {
+	if b.pkt != nil {
+		b.pkt.Release()
+		b.pkt = nil
+	}
+	if b.chunk != nil {
+		b.chunk.Release()
+		b.chunk = nil
+	}
+}
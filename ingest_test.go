@@ -0,0 +1,206 @@
+package main
+
+import (
+	"bytes"
+	"fmt"
+	"testing"
+)
+
+// testFrames returns one wire frame per size, each with its index as PTS and
+// a payload pattern derived from it, and the frames concatenated.
+func testFrames(sizes []int) ([][]byte, []byte) {
+	var frames [][]byte
+	var stream []byte
+	for i, size := range sizes {
+		h := Header{Pts: int64(i), Dts: int64(i), StreamIndex: 1, Size: int32(size)}
+		frame := make([]byte, HeaderSize+size)
+		h.Encode(frame)
+		for j := range frame[HeaderSize:] {
+			frame[HeaderSize+j] = byte(i*7 + j)
+		}
+		frames = append(frames, frame)
+		stream = append(stream, frame...)
+	}
+	return frames, stream
+}
+
+func newTestPushSession(queue int) *PushSession {
+	return &PushSession{
+		server:   &Server{},
+		StreamID: "test",
+		State:    &State{ID: "test", Queue: make(chan *Packet, queue)},
+	}
+}
+
+// checkPackets takes every queued packet, compares it with the next of
+// frames and releases it. It returns how many packets it took.
+func checkPackets(t *testing.T, session *PushSession, frames [][]byte, next int) int {
+	t.Helper()
+	for {
+		select {
+		case pkt := <-session.State.Queue:
+			if next >= len(frames) {
+				t.Fatalf("unexpected packet %+v", pkt.Header)
+			}
+			want := frames[next]
+			if pkt.Header != DecodeHeader(want) || !bytes.Equal(pkt.Head[:], want[:HeaderSize]) {
+				t.Fatalf("packet %d: header %+v, want %+v", next, pkt.Header, DecodeHeader(want))
+			}
+			if !bytes.Equal(pkt.Payload, want[HeaderSize:]) {
+				t.Fatalf("packet %d: payload of %d bytes differs from the %d sent", next, len(pkt.Payload), len(want)-HeaderSize)
+			}
+			pkt.Release()
+			next++
+		default:
+			return next
+		}
+	}
+}
+
+func TestIngestBuffer(t *testing.T) {
+	small := make([]int, 200)
+	for i := range small {
+		small[i] = i * 13 % 1500
+	}
+	// packets just under the chunked limit, so that the incomplete frame
+	// is moved to a fresh chunk every few packets
+	nearLimit := []int{IngestMaxChunkedSize - 1, IngestMaxChunkedSize, 1, IngestMaxChunkedSize - 100, IngestMaxChunkedSize, IngestMaxChunkedSize, 500}
+	// payloads over 64 KiB are read straight into a packet of their own
+	large := []int{100, IngestMaxChunkedSize + 1, 0, 1 << 20, 200, IngestChunkSize, IngestChunkSize + 1, 7}
+
+	for _, tc := range []struct {
+		name  string
+		sizes []int
+	}{
+		{"empty payloads", []int{0, 0, 0}},
+		{"small", small},
+		{"near the chunked limit", nearLimit},
+		{"large", large},
+		{"mixed", append(append(append([]int{}, small[:50]...), large...), nearLimit...)},
+	} {
+		frames, stream := testFrames(tc.sizes)
+		// reads of 1 and 7 bytes split headers and payloads everywhere,
+		// 0 reads as much as space offers
+		for _, readSize := range []int{1, 7, 4093, IngestMinRead, 0} {
+			if readSize == 1 && len(stream) > 1<<20 {
+				continue
+			}
+			for _, prefix := range []int{0, 5, HeaderSize + 3} {
+				for _, hold := range []bool{false, true} {
+					name := fmt.Sprintf("%s/read=%d/prefix=%d/hold=%v", tc.name, readSize, prefix, hold)
+					t.Run(name, func(t *testing.T) {
+						testIngest(t, frames, stream, readSize, prefix, hold)
+					})
+				}
+			}
+		}
+	}
+}
+
+// testIngest feeds stream to an ingest buffer, the first prefix bytes through
+// write and the rest through reads of at most readSize bytes. With hold set
+// the packets are only checked at the end, so the buffer must not reuse any
+// chunk a packet still points into.
+func testIngest(t *testing.T, frames [][]byte, stream []byte, readSize, prefix int, hold bool) {
+	session := newTestPushSession(len(frames) + 1)
+	var b ingestBuffer
+	defer b.Close()
+
+	prefix = min(prefix, len(stream))
+	if err := b.write(stream[:prefix], session); err != nil {
+		t.Fatal(err)
+	}
+	next := 0
+	for rest := stream[prefix:]; len(rest) > 0; {
+		space := b.space()
+		if len(space) == 0 {
+			t.Fatalf("no space with %d bytes left", len(rest))
+		}
+		if readSize > 0 && len(space) > readSize {
+			space = space[:readSize]
+		}
+		n := copy(space, rest)
+		rest = rest[n:]
+		if err := b.commit(n, session); err != nil {
+			t.Fatal(err)
+		}
+		if !hold {
+			next = checkPackets(t, session, frames, next)
+		}
+	}
+	if next = checkPackets(t, session, frames, next); next != len(frames) {
+		t.Fatalf("got %d packets, want %d", next, len(frames))
+	}
+	if b.pkt != nil || (b.chunk != nil && b.r != b.w) {
+		t.Fatalf("buffer holds an incomplete frame after the last packet")
+	}
+}
+
+func TestIngestBufferChunkReferences(t *testing.T) {
+	frames, stream := testFrames([]int{10, 20, 30})
+	session := newTestPushSession(len(frames))
+	var b ingestBuffer
+	if err := b.write(stream, session); err != nil {
+		t.Fatal(err)
+	}
+	c := b.chunk
+	if refs := c.refs.Load(); refs != 1+int32(len(frames)) {
+		t.Fatalf("chunk has %d references, want the buffer's and one per packet", refs)
+	}
+
+	// the chunk outlives the buffer while packets point into it
+	b.Close()
+	if refs := c.refs.Load(); refs != int32(len(frames)) {
+		t.Fatalf("chunk has %d references after Close, want %d", refs, len(frames))
+	}
+	if n := checkPackets(t, session, frames, 0); n != len(frames) {
+		t.Fatalf("got %d packets, want %d", n, len(frames))
+	}
+	if refs := c.refs.Load(); refs != 0 {
+		t.Fatalf("chunk has %d references after every packet was released", refs)
+	}
+}
+
+func TestIngestBufferMovesFrameThatCannotFit(t *testing.T) {
+	// four packets and a fifth sized so that the sixth starts 10000 bytes
+	// before the end of the chunk, with room for IngestMinRead more but
+	// not for its 20000-byte payload
+	fifth := IngestChunkSize - 10000 - 4*(HeaderSize+60000) - HeaderSize
+	frames, stream := testFrames([]int{60000, 60000, 60000, 60000, fifth, 20000})
+	session := newTestPushSession(len(frames))
+	var b ingestBuffer
+	defer b.Close()
+
+	partial := len(stream) - len(frames[5]) + HeaderSize + 100
+	if err := b.write(stream[:partial], session); err != nil {
+		t.Fatal(err)
+	}
+	if b.r != IngestChunkSize-10000 {
+		t.Fatalf("sixth frame starts at %d, want %d", b.r, IngestChunkSize-10000)
+	}
+
+	space := b.space()
+	if b.r != 0 || b.w != HeaderSize+100 || len(space) != IngestChunkSize-b.w {
+		t.Fatalf("incomplete frame at %d..%d with %d bytes of space, want it moved to the start of a fresh chunk", b.r, b.w, len(space))
+	}
+	if err := b.write(stream[partial:], session); err != nil {
+		t.Fatal(err)
+	}
+	if n := checkPackets(t, session, frames, 0); n != len(frames) {
+		t.Fatalf("got %d packets, want %d", n, len(frames))
+	}
+}
+
+func TestIngestBufferInvalidSize(t *testing.T) {
+	for _, size := range []int32{-1, MaxPacketSize + 1} {
+		head := make([]byte, HeaderSize)
+		(&Header{Size: size}).Encode(head)
+
+		var b ingestBuffer
+		err := b.write(head, newTestPushSession(1))
+		b.Close()
+		if err == nil {
+			t.Errorf("size %d: no error", size)
+		}
+	}
+}
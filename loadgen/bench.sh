@@ -0,0 +1,52 @@
+#!/bin/sh
+# Repeatable relay benchmark. Runs every scenario against a fresh relay on
+# loopback and appends one JSON result per scenario to
+# bench-results/<label>.jsonl, where label defaults to `git describe`.
+# Compare two runs with:
+#
+#	go run ./loadgen -compare bench-results/v1.jsonl bench-results/v2.jsonl
+#
+# Run from the repository root. REPLAY pushes a recording instead of
+# synthetic packets. 50k viewers need `ulimit -n` above 100000.
+set -e
+
+LABEL=${LABEL:-$(git describe --always --dirty)}
+VIEWERS=${VIEWERS:-"1000 10000 50000"}
+ENGINES=${ENGINES:-"goroutine epoll"}
+PUBLISHERS=${PUBLISHERS:-1}
+DURATION=${DURATION:-10s}
+REPLAY=${REPLAY:-}
+OUT=${OUT:-bench-results/$LABEL.jsonl}
+
+mkdir -p "$(dirname "$OUT")"
+go build -o /tmp/sfu-bench .
+go build -o /tmp/sfu-loadgen ./loadgen
+
+for engine in $ENGINES; do
+	for viewers in $VIEWERS; do
+		/tmp/sfu-bench -engine "$engine" -log-level warn -record-dir "" -debug-addr "" &
+		server=$!
+		sleep 1
+
+		sources=$(( (viewers + 19999) / 20000 ))
+		/tmp/sfu-loadgen -pid "$server" -scenario "$engine-$PUBLISHERS-$viewers" -label "$LABEL" -out "$OUT" \
+			-publishers "$PUBLISHERS" -viewers "$viewers" -sources "$sources" -duration "$DURATION" \
+			${REPLAY:+-replay "$REPLAY"} || echo "$engine-$PUBLISHERS-$viewers: loadgen failed" >&2
+
+		kill "$server"
+		wait "$server" 2>/dev/null || true
+	done
+done
+
+# Handshakes per second with the JSON and the binary handshake.
+HANDSHAKES=${HANDSHAKES:-20000}
+/tmp/sfu-bench -log-level warn -record-dir "" -debug-addr "" &
+server=$!
+sleep 1
+for binary in false true; do
+	/tmp/sfu-loadgen -stream "handshake-$binary" -binary="$binary" -handshakes "$HANDSHAKES" -dialers 16 || true
+done
+kill "$server"
+wait "$server" 2>/dev/null || true
+
+echo "results in $OUT"
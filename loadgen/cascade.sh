@@ -0,0 +1,36 @@
+#!/bin/sh
+# Runs an origin and EDGES edge relays on loopback, pushes one stream to the
+# origin and spreads VIEWERS viewers over the edges. Run from the repository
+# root. Each edge should hold exactly one upstream connection to the origin.
+set -e
+
+EDGES=${EDGES:-3}
+VIEWERS=${VIEWERS:-300}
+DURATION=${DURATION:-10s}
+
+go build -o /tmp/sfu-bench .
+go build -o /tmp/sfu-loadgen ./loadgen
+
+logs=$(mktemp -d)
+/tmp/sfu-bench -listen 127.0.0.1:1935 -record-dir "" -debug-addr "" -metrics-addr "" 2>"$logs/origin.log" &
+pids=$!
+
+pull=""
+for i in $(seq 1 "$EDGES"); do
+	port=$((1935 + i))
+	/tmp/sfu-bench -listen "127.0.0.1:$port" -origin 127.0.0.1:1935 -record-dir "" -debug-addr "" -metrics-addr "" 2>"$logs/edge$i.log" &
+	pids="$pids $!"
+	pull="$pull${pull:+,}127.0.0.1:$port"
+done
+sleep 1
+
+/tmp/sfu-loadgen -addr 127.0.0.1:1935 -pull "$pull" -viewers "$VIEWERS" -duration "$DURATION" || true
+
+kill $pids
+wait 2>/dev/null || true
+
+echo "upstream connections per edge:"
+for i in $(seq 1 "$EDGES"); do
+	echo "edge$i: $(grep -c 'Pulling stream from origin' "$logs/edge$i.log")"
+done
+echo "origin pull clients: $(grep -c 'Pull client connected' "$logs/origin.log")"
@@ -0,0 +1,93 @@
+package main
+
+import (
+	"bufio"
+	"encoding/json"
+	"fmt"
+	"io"
+	"os"
+	"text/tabwriter"
+)
+
+// compareResults prints, for every scenario found in both files, the key
+// metrics of the last result of each and their relative change.
+func compareResults(w io.Writer, oldPath, newPath string) error {
+	oldResults, order, err := readResults(oldPath)
+	if err != nil {
+		return err
+	}
+	newResults, _, err := readResults(newPath)
+	if err != nil {
+		return err
+	}
+
+	tw := tabwriter.NewWriter(w, 0, 0, 2, ' ', tabwriter.AlignRight)
+	fmt.Fprintln(tw, "scenario\tmetric\told\tnew\tchange\t")
+	for _, scenario := range order {
+		newer, ok := newResults[scenario]
+		if !ok {
+			continue
+		}
+		older := oldResults[scenario]
+		for _, m := range []struct {
+			name     string
+			old, new float64
+		}{
+			{"packets/s", older.PacketsPerSec, newer.PacketsPerSec},
+			{"MB/s", older.BytesPerSec / 1e6, newer.BytesPerSec / 1e6},
+			{"latency p50 ms", older.Latency.P50, newer.Latency.P50},
+			{"latency p99 ms", older.Latency.P99, newer.Latency.P99},
+			{"latency max ms", older.Latency.Max, newer.Latency.Max},
+			{"drop ratio", older.DropRatio, newer.DropRatio},
+			{"connect p99 ms", older.ConnectP99Ms, newer.ConnectP99Ms},
+			{"server cpu %", serverCPU(older), serverCPU(newer)},
+			{"server max rss MB", serverRSS(older), serverRSS(newer)},
+		} {
+			change := "-"
+			if m.old != 0 {
+				change = fmt.Sprintf("%+.1f%%", 100*(m.new-m.old)/m.old)
+			}
+			fmt.Fprintf(tw, "%s\t%s\t%.3f\t%.3f\t%s\t\n", scenario, m.name, m.old, m.new, change)
+		}
+	}
+	return tw.Flush()
+}
+
+// readResults returns the last result of every scenario in path, and the
+// scenarios in the order they first appear.
+func readResults(path string) (map[string]*Result, []string, error) {
+	file, err := os.Open(path)
+	if err != nil {
+		return nil, nil, err
+	}
+	defer file.Close()
+
+	results := map[string]*Result{}
+	var order []string
+	scanner := bufio.NewScanner(file)
+	for scanner.Scan() {
+		result := &Result{}
+		if err := json.Unmarshal(scanner.Bytes(), result); err != nil {
+			return nil, nil, fmt.Errorf("%s: %w", path, err)
+		}
+		if _, ok := results[result.Scenario]; !ok {
+			order = append(order, result.Scenario)
+		}
+		results[result.Scenario] = result
+	}
+	return results, order, scanner.Err()
+}
+
+func serverCPU(r *Result) float64 {
+	if r.Server == nil {
+		return 0
+	}
+	return r.Server.CPUPercent
+}
+
+func serverRSS(r *Result) float64 {
+	if r.Server == nil {
+		return 0
+	}
+	return float64(r.Server.MaxRSSKB) / 1024
+}
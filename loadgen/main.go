@@ -0,0 +1,411 @@
+// loadgen measures a relay on loopback. It pushes synthetic or recorded
+// streams from N publishers, attaches M viewers speaking the real handshake
+// and framing, and reports throughput, end-to-end latency from send
+// timestamps embedded in the payloads, drops and the relay's CPU and memory
+// use as one JSON line. With -handshakes it instead measures how many pull
+// handshakes per second the relay completes, and -compare prints the change
+// between two result files.
+package main
+
+import (
+	"encoding/json"
+	"flag"
+	"fmt"
+	"log"
+	"net"
+	"os"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+type Result struct {
+	Scenario     string  `json:"scenario,omitempty"`
+	Label        string  `json:"label,omitempty"`
+	Time         string  `json:"time"`
+	Publishers   int     `json:"publishers"`
+	Viewers      int     `json:"viewers"`
+	Connected    int64   `json:"connected"`
+	Failed       int64   `json:"failed"`
+	Disconnected int64   `json:"disconnected"`
+	ConnectP50Ms float64 `json:"connect_p50_ms"`
+	ConnectP99Ms float64 `json:"connect_p99_ms"`
+	DurationSec  float64 `json:"duration_sec"`
+
+	SentPackets   int64   `json:"sent_packets"`
+	SentBytes     int64   `json:"sent_bytes"`
+	Packets       int64   `json:"received_packets"`
+	Bytes         int64   `json:"received_bytes"`
+	PacketsPerSec float64 `json:"packets_per_sec"`
+	BytesPerSec   float64 `json:"bytes_per_sec"`
+	Dropped       int64   `json:"dropped_packets"`
+	DropRatio     float64 `json:"drop_ratio"`
+
+	Latency   Percentiles `json:"latency_ms"`
+	ViewerP99 Percentiles `json:"viewer_p99_latency_ms"`
+
+	Server *ServerUsage `json:"server,omitempty"`
+}
+
+type ServerUsage struct {
+	CPUPercent float64 `json:"cpu_percent"`
+	RSSKB      int64   `json:"rss_kb"`
+	MaxRSSKB   int64   `json:"max_rss_kb"`
+}
+
+func main() {
+	addr := flag.String("addr", "127.0.0.1:1935", "relay address publishers push to")
+	pullAddrs := flag.String("pull", "", "comma-separated addresses viewers pull from, round robin, default -addr")
+	streamID := flag.String("stream", "loadgen", "stream ID, suffixed with the publisher index when there are several")
+	publishers := flag.Int("publishers", 1, "number of publishers, one stream each")
+	viewers := flag.Int("viewers", 1000, "number of viewers, spread over the streams")
+	warmup := flag.Duration("warmup", 2*time.Second, "time between the last viewer joining and the start of the measurement")
+	duration := flag.Duration("duration", 10*time.Second, "length of the measurement")
+	replay := flag.String("replay", "", "recording (.sfu) to push in a loop instead of synthetic packets")
+	fps := flag.Int("fps", 30, "video frames per second")
+	size := flag.Int("size", 4000, "synthetic video payload size in bytes")
+	gop := flag.Int("gop", 60, "synthetic frames per keyframe interval")
+	sources := flag.Int("sources", 1, "spread viewers over this many loopback source addresses (127.0.0.2 and up) to get past the ephemeral port range")
+	dialers := flag.Int("dialers", 64, "concurrent viewer dials")
+	keepalive := flag.Duration("keepalive", time.Second, "viewer keepalive interval, 0 to disable")
+	pid := flag.Int("pid", 0, "relay process whose CPU and memory use is reported")
+	scenario := flag.String("scenario", "", "scenario name recorded in the result, used by -compare")
+	label := flag.String("label", "", "free-form label recorded in the result, such as a release")
+	out := flag.String("out", "", "append the result to this file instead of printing it")
+	handshakes := flag.Int("handshakes", 0, "only measure this many pull handshakes")
+	compare := flag.Bool("compare", false, "compare two result files given as arguments")
+	flag.BoolVar(&binaryHandshake, "binary", false, "use the binary handshake instead of JSON")
+	flag.Parse()
+
+	if *compare {
+		if flag.NArg() != 2 {
+			log.Fatal("usage: loadgen -compare old.jsonl new.jsonl")
+		}
+		if err := compareResults(os.Stdout, flag.Arg(0), flag.Arg(1)); err != nil {
+			log.Fatal(err)
+		}
+		return
+	}
+
+	targets := []string{*addr}
+	if *pullAddrs != "" {
+		targets = strings.Split(*pullAddrs, ",")
+	}
+
+	handshake := map[string]any{
+		"video_codec_id": 27, "audio_codec_id": 86018, "fps": *fps, "width": 1280, "height": 720,
+		"video_extradata": "AAAAAWdCwB7ZAKALdgIgAAADACAAAAeB4sXJ",
+	}
+	frames := syntheticFrames(*fps, *size, *gop)
+	if *replay != "" {
+		var err error
+		if handshake, frames, err = readRecording(*replay); err != nil {
+			log.Fatal(*replay, ": ", err)
+		}
+	}
+	handshake["mode"] = "push"
+
+	streams := make([]string, *publishers)
+	pubs := make([]*publisher, *publishers)
+	stop := make(chan struct{})
+	for i := range pubs {
+		streams[i] = *streamID
+		if *publishers > 1 {
+			streams[i] = fmt.Sprintf("%s-%d", *streamID, i)
+		}
+
+		conn, err := net.Dial("tcp", *addr)
+		if err != nil {
+			log.Fatal(err)
+		}
+		defer conn.Close()
+		handshake["stream_id"] = streams[i]
+		if err := writeHandshake(conn, handshake); err != nil {
+			log.Fatal(err)
+		}
+		pubs[i] = newPublisher(conn, streams[i], frames, *fps)
+	}
+
+	if err := waitForStreams(targets, streams, 10*time.Second); err != nil {
+		log.Fatal(err)
+	}
+
+	if *handshakes > 0 {
+		benchmarkHandshakes(targets[0], streams[0], *handshakes, *dialers, *sources)
+		return
+	}
+
+	for _, p := range pubs {
+		go func(p *publisher) {
+			if err := p.run(stop); err != nil {
+				log.Fatal("publisher ", p.streamID, ": ", err)
+			}
+		}(p)
+	}
+
+	var (
+		failed       atomic.Int64
+		mu           sync.Mutex
+		connectTimes []time.Duration
+		joined       []*viewer
+		dials        sync.WaitGroup
+		receivers    sync.WaitGroup
+	)
+
+	begin := time.Now()
+	slots := make(chan struct{}, *dialers)
+	for i := 0; i < *viewers; i++ {
+		slots <- struct{}{}
+		dials.Add(1)
+		go func(i int) {
+			defer dials.Done()
+
+			start := time.Now()
+			conn, err := dialViewer(targets[i%len(targets)], i%*sources)
+			if err == nil {
+				err = writeHandshake(conn, map[string]any{"mode": "pull", "stream_id": streams[i%len(streams)]})
+			}
+			if err == nil {
+				err = readResponse(conn)
+			}
+			<-slots
+			if err != nil {
+				if failed.Add(1) <= 10 {
+					log.Printf("viewer %d: %v", i, err)
+				}
+				if conn != nil {
+					conn.Close()
+				}
+				return
+			}
+
+			v := &viewer{conn: conn}
+			mu.Lock()
+			connectTimes = append(connectTimes, time.Since(start))
+			joined = append(joined, v)
+			mu.Unlock()
+
+			receivers.Add(1)
+			go func() {
+				defer receivers.Done()
+				v.receive()
+			}()
+			if *keepalive > 0 {
+				go v.keepalive(*keepalive, stop)
+			}
+		}(i)
+	}
+	dials.Wait()
+	log.Printf("%d viewers connected, %d failed in %s", len(joined), failed.Load(), time.Since(begin).Round(time.Millisecond))
+
+	time.Sleep(*warmup)
+
+	var usage *ServerUsage
+	var cpuBefore time.Duration
+	var maxRSS atomic.Int64
+	sampler := make(chan struct{})
+	if *pid != 0 {
+		var err error
+		if cpuBefore, _, err = processUsage(*pid); err != nil {
+			log.Print("server usage: ", err)
+		} else {
+			usage = &ServerUsage{}
+			go sampleRSS(*pid, &maxRSS, sampler)
+		}
+	}
+
+	sentPackets, sentBytes := sent(pubs)
+	measuring.Store(true)
+	start := time.Now()
+	time.Sleep(*duration)
+	measuring.Store(false)
+	elapsed := time.Since(start)
+	endPackets, endBytes := sent(pubs)
+	close(sampler)
+
+	if usage != nil {
+		if cpu, rss, err := processUsage(*pid); err == nil {
+			usage.CPUPercent = 100 * float64(cpu-cpuBefore) / float64(elapsed)
+			usage.RSSKB = rss
+			usage.MaxRSSKB = max(maxRSS.Load(), rss)
+		}
+	}
+
+	close(stop)
+	for _, v := range joined {
+		v.conn.Close()
+	}
+	receivers.Wait()
+
+	result := Result{
+		Scenario:    *scenario,
+		Label:       *label,
+		Time:        time.Now().UTC().Format(time.RFC3339),
+		Publishers:  *publishers,
+		Viewers:     *viewers,
+		Connected:   int64(len(joined)),
+		Failed:      failed.Load(),
+		DurationSec: elapsed.Seconds(),
+		SentPackets: endPackets - sentPackets,
+		SentBytes:   endBytes - sentBytes,
+		Server:      usage,
+	}
+
+	sort.Slice(connectTimes, func(i, j int) bool { return connectTimes[i] < connectTimes[j] })
+	result.ConnectP50Ms = percentile(connectTimes, 0.50)
+	result.ConnectP99Ms = percentile(connectTimes, 0.99)
+
+	var latency, viewerP99 histogram
+	for _, v := range joined {
+		result.Packets += v.Packets
+		result.Bytes += v.Bytes
+		result.Dropped += v.Dropped
+		if v.Disconnected {
+			result.Disconnected++
+		}
+		latency.Merge(&v.Latency)
+		if v.Latency.total > 0 {
+			viewerP99.Record(int64(v.Latency.Quantile(0.99) * float64(time.Millisecond)))
+		}
+	}
+	result.PacketsPerSec = float64(result.Packets) / elapsed.Seconds()
+	result.BytesPerSec = float64(result.Bytes) / elapsed.Seconds()
+	if result.Packets+result.Dropped > 0 {
+		result.DropRatio = float64(result.Dropped) / float64(result.Packets+result.Dropped)
+	}
+	result.Latency = latency.Percentiles()
+	result.ViewerP99 = viewerP99.Percentiles()
+
+	if err := writeResult(*out, &result); err != nil {
+		log.Fatal(err)
+	}
+}
+
+func sent(pubs []*publisher) (packets, bytes int64) {
+	for _, p := range pubs {
+		packets += p.Packets.Load()
+		bytes += p.Bytes.Load()
+	}
+	return packets, bytes
+}
+
+// sampleRSS keeps the largest resident set size of pid seen until stop is
+// closed.
+func sampleRSS(pid int, maxRSS *atomic.Int64, stop <-chan struct{}) {
+	ticker := time.NewTicker(100 * time.Millisecond)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-stop:
+			return
+		case <-ticker.C:
+		}
+		if _, rss, err := processUsage(pid); err == nil && rss > maxRSS.Load() {
+			maxRSS.Store(rss)
+		}
+	}
+}
+
+func writeResult(path string, result *Result) error {
+	w := os.Stdout
+	if path != "" {
+		file, err := os.OpenFile(path, os.O_CREATE|os.O_APPEND|os.O_WRONLY, 0o644)
+		if err != nil {
+			return err
+		}
+		defer file.Close()
+		w = file
+	}
+	return json.NewEncoder(w).Encode(result)
+}
+
+// dialViewer connects from 127.0.0.(2+source) when source is not zero, so that
+// more than one ephemeral port range is available towards the relay.
+func dialViewer(addr string, source int) (net.Conn, error) {
+	dialer := net.Dialer{Timeout: 10 * time.Second}
+	if source > 0 {
+		dialer.LocalAddr = &net.TCPAddr{IP: net.IPv4(127, 0, 0, byte(1+source))}
+	}
+	return dialer.Dial("tcp", addr)
+}
+
+// waitForStreams probes every stream on every target with a pull handshake
+// until the response arrives, so viewers only dial once the relay has
+// registered the publishers' streams and an edge has pulled them from its
+// origin. A viewer that fails after this fails for real.
+func waitForStreams(targets, streams []string, timeout time.Duration) error {
+	deadline := time.Now().Add(timeout)
+	for _, addr := range targets {
+		for _, streamID := range streams {
+			for {
+				conn, err := dialViewer(addr, 0)
+				if err == nil {
+					err = writeHandshake(conn, map[string]any{"mode": "pull", "stream_id": streamID})
+				}
+				if err == nil {
+					err = readResponse(conn)
+				}
+				if conn != nil {
+					conn.Close()
+				}
+				if err == nil {
+					break
+				}
+				if time.Now().After(deadline) {
+					return fmt.Errorf("stream %q not available on %s: %w", streamID, addr, err)
+				}
+				time.Sleep(10 * time.Millisecond)
+			}
+		}
+	}
+	return nil
+}
+
+// benchmarkHandshakes opens count pull connections, workers at a time, each of
+// which sends its handshake, reads the response and hangs up.
+func benchmarkHandshakes(addr, streamID string, count, workers, sources int) {
+	var next, failed atomic.Int64
+	var wg sync.WaitGroup
+
+	begin := time.Now()
+	for w := 0; w < workers; w++ {
+		wg.Add(1)
+		go func(w int) {
+			defer wg.Done()
+			for next.Add(1) <= int64(count) {
+				conn, err := dialViewer(addr, w%sources)
+				if err == nil {
+					err = writeHandshake(conn, map[string]any{"mode": "pull", "stream_id": streamID})
+				}
+				if err == nil {
+					err = readResponse(conn)
+				}
+				if conn != nil {
+					conn.Close()
+				}
+				if err != nil && failed.Add(1) <= 10 {
+					log.Print(err)
+				}
+			}
+		}(w)
+	}
+	wg.Wait()
+	elapsed := time.Since(begin)
+
+	json.NewEncoder(os.Stdout).Encode(map[string]any{
+		"binary":         binaryHandshake,
+		"handshakes":     count,
+		"failed":         failed.Load(),
+		"duration_sec":   elapsed.Seconds(),
+		"handshakes_sec": float64(count) / elapsed.Seconds(),
+	})
+}
+
+func percentile(sorted []time.Duration, p float64) float64 {
+	if len(sorted) == 0 {
+		return 0
+	}
+	return float64(sorted[int(p*float64(len(sorted)-1))]) / float64(time.Millisecond)
+}
@@ -0,0 +1,34 @@
+//go:build linux
+
+package main
+
+import (
+	"bytes"
+	"fmt"
+	"os"
+	"strconv"
+	"time"
+)
+
+// clockTicks is USER_HZ, which is 100 on every Linux architecture Go supports.
+const clockTicks = 100
+
+// processUsage returns the CPU time used so far by pid and its resident set
+// size in KiB.
+func processUsage(pid int) (time.Duration, int64, error) {
+	stat, err := os.ReadFile(fmt.Sprintf("/proc/%d/stat", pid))
+	if err != nil {
+		return 0, 0, err
+	}
+	// the command name may contain spaces, so count fields after its ')'
+	fields := bytes.Fields(stat[bytes.LastIndexByte(stat, ')')+1:])
+	if len(fields) < 22 {
+		return 0, 0, fmt.Errorf("short /proc/%d/stat", pid)
+	}
+	utime, _ := strconv.ParseInt(string(fields[11]), 10, 64)
+	stime, _ := strconv.ParseInt(string(fields[12]), 10, 64)
+	rssPages, _ := strconv.ParseInt(string(fields[21]), 10, 64)
+
+	cpu := time.Duration(utime+stime) * time.Second / clockTicks
+	return cpu, rssPages * int64(os.Getpagesize()) / 1024, nil
+}
@@ -0,0 +1,12 @@
+//go:build !linux
+
+package main
+
+import (
+	"errors"
+	"time"
+)
+
+func processUsage(pid int) (time.Duration, int64, error) {
+	return 0, 0, errors.New("server usage is only available on Linux")
+}
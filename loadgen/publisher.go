@@ -0,0 +1,123 @@
+package main
+
+import (
+	"encoding/binary"
+	"net"
+	"sync/atomic"
+	"time"
+)
+
+// StampSize bytes at the start of every payload large enough are replaced
+// with the send time in Unix nanoseconds and a per-stream sequence number,
+// so viewers can measure end-to-end latency and count lost packets.
+const StampSize = 16
+
+type frame struct {
+	head    [HeaderSize]byte
+	payload []byte
+}
+
+func (f *frame) isVideo() bool {
+	return binary.LittleEndian.Uint32(f.head[16:]) == 0
+}
+
+// publisher pushes one stream, looping over frames. Video frames are paced at
+// fps; every other packet is sent right after the video frame before it.
+type publisher struct {
+	streamID string
+	conn     net.Conn
+	frames   []frame
+	fps      int
+
+	// loop is added to pts and dts on every pass over frames so that
+	// timestamps keep increasing.
+	loop int64
+	seq  uint64
+
+	Packets atomic.Int64
+	Bytes   atomic.Int64
+}
+
+// syntheticFrames returns one GOP of gop video frames of size bytes, the first
+// a keyframe, each followed by a 256-byte audio packet.
+func syntheticFrames(fps, size, gop int) []frame {
+	frames := make([]frame, 0, 2*gop)
+	video := make([]byte, size)
+	audio := make([]byte, 256)
+	for i := 0; i < gop; i++ {
+		pts := int64(i) * 1000 / int64(fps)
+		flags := int32(0)
+		if i == 0 {
+			flags = 1
+		}
+		var v, a frame
+		encodeHeader(v.head[:], pts, 0, flags, size)
+		encodeHeader(a.head[:], pts, 1, 1, len(audio))
+		v.payload, a.payload = video, audio
+		frames = append(frames, v, a)
+	}
+	return frames
+}
+
+func newPublisher(conn net.Conn, streamID string, frames []frame, fps int) *publisher {
+	p := &publisher{streamID: streamID, conn: conn, frames: frames, fps: fps}
+
+	var first, last, prev int64
+	count := 0
+	for i := range frames {
+		if !frames[i].isVideo() {
+			continue
+		}
+		pts := int64(binary.LittleEndian.Uint64(frames[i].head[0:]))
+		if count == 0 {
+			first = pts
+		}
+		prev, last = last, pts
+		count++
+	}
+	p.loop = last - first
+	if count > 1 {
+		p.loop += last - prev
+	} else {
+		p.loop++
+	}
+	return p
+}
+
+func (p *publisher) run(stop <-chan struct{}) error {
+	ticker := time.NewTicker(time.Second / time.Duration(p.fps))
+	defer ticker.Stop()
+
+	var head [HeaderSize]byte
+	var stamp [StampSize]byte
+	for pass := int64(0); ; pass++ {
+		for i := range p.frames {
+			f := &p.frames[i]
+			if f.isVideo() {
+				select {
+				case <-stop:
+					return nil
+				case <-ticker.C:
+				}
+			}
+
+			head = f.head
+			offset := pass * p.loop
+			binary.LittleEndian.PutUint64(head[0:], binary.LittleEndian.Uint64(f.head[0:])+uint64(offset))
+			binary.LittleEndian.PutUint64(head[8:], binary.LittleEndian.Uint64(f.head[8:])+uint64(offset))
+
+			bufs := net.Buffers{head[:], f.payload}
+			if len(f.payload) >= StampSize {
+				p.seq++
+				binary.LittleEndian.PutUint64(stamp[0:], uint64(time.Now().UnixNano()))
+				binary.LittleEndian.PutUint64(stamp[8:], p.seq)
+				bufs = net.Buffers{head[:], stamp[:], f.payload[StampSize:]}
+			}
+			if _, err := bufs.WriteTo(p.conn); err != nil {
+				return err
+			}
+			p.Packets.Add(1)
+			p.Bytes.Add(int64(HeaderSize + len(f.payload)))
+		}
+	}
+}
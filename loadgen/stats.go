@@ -0,0 +1,84 @@
+package main
+
+import (
+	"math/bits"
+	"time"
+)
+
+// histogram counts durations in nanoseconds in log-linear buckets: exact below
+// histSub microseconds, then histSub buckets per power of two, so every
+// quantile is within 1/histSub of the true value.
+const (
+	histSub     = 64
+	histBuckets = 40 * histSub
+)
+
+type histogram struct {
+	counts [histBuckets]uint64
+	total  uint64
+	max    int64
+}
+
+func (h *histogram) Record(ns int64) {
+	us := uint64(max(ns, 0) / int64(time.Microsecond))
+	index := int(us)
+	if us >= histSub {
+		shift := bits.Len64(us) - 7
+		index = (shift+1)*histSub + int(us>>shift) - histSub
+	}
+	h.counts[min(index, histBuckets-1)]++
+	h.total++
+	h.max = max(h.max, ns)
+}
+
+func (h *histogram) Merge(other *histogram) {
+	for i, count := range other.counts {
+		h.counts[i] += count
+	}
+	h.total += other.total
+	h.max = max(h.max, other.max)
+}
+
+// Quantile returns the q-quantile in milliseconds.
+func (h *histogram) Quantile(q float64) float64 {
+	if h.total == 0 {
+		return 0
+	}
+	rank := uint64(q * float64(h.total-1))
+	var seen uint64
+	for i, count := range h.counts {
+		seen += count
+		if seen > rank {
+			return float64(bucketValue(i)) / 1000
+		}
+	}
+	return float64(h.max) / float64(time.Millisecond)
+}
+
+// bucketValue returns the lowest value in microseconds of bucket i.
+func bucketValue(i int) uint64 {
+	if i < histSub {
+		return uint64(i)
+	}
+	shift := i/histSub - 1
+	return uint64(i%histSub+histSub) << shift
+}
+
+// Percentiles is the latency summary written to results, in milliseconds.
+type Percentiles struct {
+	P50  float64 `json:"p50"`
+	P90  float64 `json:"p90"`
+	P99  float64 `json:"p99"`
+	P999 float64 `json:"p999"`
+	Max  float64 `json:"max"`
+}
+
+func (h *histogram) Percentiles() Percentiles {
+	return Percentiles{
+		P50:  h.Quantile(0.50),
+		P90:  h.Quantile(0.90),
+		P99:  h.Quantile(0.99),
+		P999: h.Quantile(0.999),
+		Max:  float64(h.max) / float64(time.Millisecond),
+	}
+}
@@ -0,0 +1,90 @@
+package main
+
+import (
+	"encoding/binary"
+	"errors"
+	"io"
+	"net"
+	"sync/atomic"
+	"time"
+)
+
+// measuring is set for the measurement window; viewers only count what they
+// receive while it is.
+var measuring atomic.Bool
+
+type viewer struct {
+	conn net.Conn
+
+	Packets      int64
+	Bytes        int64
+	Dropped      int64
+	Disconnected bool
+	Latency      histogram
+
+	lastSeq uint64
+}
+
+// receive reads packets until the connection closes.
+func (v *viewer) receive() {
+	head := make([]byte, HeaderSize)
+	buf := make([]byte, 64<<10)
+	for {
+		if _, err := io.ReadFull(v.conn, head); err != nil {
+			v.Disconnected = !isClosed(err)
+			return
+		}
+		size := int(binary.LittleEndian.Uint32(head[24:]))
+		if size > len(buf) {
+			buf = make([]byte, size)
+		}
+		payload := buf[:size]
+		if _, err := io.ReadFull(v.conn, payload); err != nil {
+			v.Disconnected = !isClosed(err)
+			return
+		}
+
+		if size < StampSize {
+			if measuring.Load() {
+				v.Packets++
+				v.Bytes += int64(HeaderSize + size)
+			}
+			continue
+		}
+
+		sent := int64(binary.LittleEndian.Uint64(payload[0:]))
+		seq := binary.LittleEndian.Uint64(payload[8:])
+		if measuring.Load() {
+			v.Packets++
+			v.Bytes += int64(HeaderSize + size)
+			v.Latency.Record(time.Now().UnixNano() - sent)
+			if v.lastSeq != 0 && seq > v.lastSeq+1 {
+				v.Dropped += int64(seq - v.lastSeq - 1)
+			}
+		}
+		v.lastSeq = seq
+	}
+}
+
+// keepalive sends a byte every interval until stop is closed, like the
+// interactive pull client.
+func (v *viewer) keepalive(interval time.Duration, stop <-chan struct{}) {
+	ticker := time.NewTicker(interval)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-stop:
+			return
+		case <-ticker.C:
+		}
+		if _, err := v.conn.Write([]byte{0}); err != nil {
+			return
+		}
+	}
+}
+
+// isClosed tells the viewer closing its own connection from the relay
+// dropping it.
+func isClosed(err error) bool {
+	return errors.Is(err, net.ErrClosed)
+}
@@ -0,0 +1,195 @@
+package main
+
+import (
+	"bufio"
+	"encoding/base64"
+	"encoding/binary"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"io"
+	"net"
+	"os"
+)
+
+const (
+	HeaderSize     = 28
+	HandshakeMagic = 0x42554653
+)
+
+var binaryHandshake bool
+
+func writeHandshake(conn net.Conn, handshake map[string]any) error {
+	if binaryHandshake {
+		_, err := conn.Write(encodeBinaryHandshake(handshake))
+		return err
+	}
+
+	payload, err := json.Marshal(handshake)
+	if err != nil {
+		return err
+	}
+	buf := make([]byte, 4+len(payload))
+	binary.LittleEndian.PutUint32(buf, uint32(len(payload)))
+	copy(buf[4:], payload)
+	_, err = conn.Write(buf)
+	return err
+}
+
+func readResponse(conn net.Conn) error {
+	_, _, err := readHandshake(conn)
+	if err != nil {
+		return fmt.Errorf("read response: %w", err)
+	}
+	return nil
+}
+
+// readHandshake reads a framed handshake in either encoding and returns its
+// body and whether it is binary.
+func readHandshake(r io.Reader) ([]byte, bool, error) {
+	var length [4]byte
+	if _, err := io.ReadFull(r, length[:]); err != nil {
+		return nil, false, err
+	}
+	binaryFrame := binary.LittleEndian.Uint32(length[:]) == HandshakeMagic
+	if binaryFrame {
+		if _, err := io.ReadFull(r, length[:]); err != nil {
+			return nil, false, err
+		}
+	}
+	n := binary.LittleEndian.Uint32(length[:])
+	if n > 1<<20 {
+		return nil, false, fmt.Errorf("handshake too large: %d bytes", n)
+	}
+	body := make([]byte, n)
+	if _, err := io.ReadFull(r, body); err != nil {
+		return nil, false, err
+	}
+	return body, binaryFrame, nil
+}
+
+var handshakeFields = []string{"video_codec_id", "audio_codec_id", "fps", "width", "height"}
+
+// encodeBinaryHandshake frames handshake in the relay's binary handshake
+// layout: magic, body length, version, mode, five u32 fields and TLVs.
+func encodeBinaryHandshake(handshake map[string]any) []byte {
+	mode := byte(2)
+	if handshake["mode"] == "push" {
+		mode = 1
+	}
+
+	body := []byte{1, mode, 0, 0}
+	for _, name := range handshakeFields {
+		body = binary.LittleEndian.AppendUint32(body, uint32(toInt(handshake[name])))
+	}
+
+	appendTLV := func(typ uint16, value []byte) {
+		body = binary.LittleEndian.AppendUint16(body, typ)
+		body = binary.LittleEndian.AppendUint32(body, uint32(len(value)))
+		body = append(body, value...)
+	}
+	streamID, _ := handshake["stream_id"].(string)
+	appendTLV(1, []byte(streamID))
+	for typ, name := range map[uint16]string{2: "video_extradata", 3: "audio_extradata"} {
+		if encoded, ok := handshake[name].(string); ok && encoded != "" {
+			extra, _ := base64.StdEncoding.DecodeString(encoded)
+			appendTLV(typ, extra)
+		}
+	}
+
+	b := binary.LittleEndian.AppendUint32(nil, HandshakeMagic)
+	b = binary.LittleEndian.AppendUint32(b, uint32(len(body)))
+	return append(b, body...)
+}
+
+// decodeHandshake turns a handshake body in either encoding into the map
+// writeHandshake takes.
+func decodeHandshake(body []byte, binaryFrame bool) (map[string]any, error) {
+	handshake := map[string]any{}
+	if !binaryFrame {
+		return handshake, json.Unmarshal(body, &handshake)
+	}
+
+	if len(body) < 24 {
+		return nil, errors.New("binary handshake too short")
+	}
+	for i, name := range handshakeFields {
+		handshake[name] = int(binary.LittleEndian.Uint32(body[4+4*i:]))
+	}
+	for tlvs := body[24:]; len(tlvs) >= 6; {
+		typ := binary.LittleEndian.Uint16(tlvs)
+		n := int(binary.LittleEndian.Uint32(tlvs[2:]))
+		tlvs = tlvs[6:]
+		if n > len(tlvs) {
+			return nil, errors.New("truncated handshake TLV")
+		}
+		switch typ {
+		case 1:
+			handshake["stream_id"] = string(tlvs[:n])
+		case 2:
+			handshake["video_extradata"] = base64.StdEncoding.EncodeToString(tlvs[:n])
+		case 3:
+			handshake["audio_extradata"] = base64.StdEncoding.EncodeToString(tlvs[:n])
+		}
+		tlvs = tlvs[n:]
+	}
+	return handshake, nil
+}
+
+func toInt(v any) int {
+	switch v := v.(type) {
+	case int:
+		return v
+	case float64:
+		return int(v)
+	}
+	return 0
+}
+
+// readRecording loads a relay recording: the publisher's handshake followed by
+// every packet in push framing.
+func readRecording(path string) (map[string]any, []frame, error) {
+	file, err := os.Open(path)
+	if err != nil {
+		return nil, nil, err
+	}
+	defer file.Close()
+	r := bufio.NewReaderSize(file, 1<<20)
+
+	body, binaryFrame, err := readHandshake(r)
+	if err != nil {
+		return nil, nil, fmt.Errorf("read handshake: %w", err)
+	}
+	handshake, err := decodeHandshake(body, binaryFrame)
+	if err != nil {
+		return nil, nil, err
+	}
+
+	var frames []frame
+	for {
+		var f frame
+		if _, err := io.ReadFull(r, f.head[:]); err != nil {
+			if err == io.EOF {
+				break
+			}
+			return nil, nil, fmt.Errorf("read packet %d: %w", len(frames), err)
+		}
+		f.payload = make([]byte, binary.LittleEndian.Uint32(f.head[24:]))
+		if _, err := io.ReadFull(r, f.payload); err != nil {
+			return nil, nil, fmt.Errorf("read packet %d: %w", len(frames), err)
+		}
+		frames = append(frames, f)
+	}
+	if len(frames) == 0 {
+		return nil, nil, errors.New("recording has no packets")
+	}
+	return handshake, frames, nil
+}
+
+func encodeHeader(b []byte, pts int64, index, flags int32, size int) {
+	binary.LittleEndian.PutUint64(b[0:], uint64(pts))
+	binary.LittleEndian.PutUint64(b[8:], uint64(pts))
+	binary.LittleEndian.PutUint32(b[16:], uint32(index))
+	binary.LittleEndian.PutUint32(b[20:], uint32(flags))
+	binary.LittleEndian.PutUint32(b[24:], uint32(size))
+}
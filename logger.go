@@ -0,0 +1,167 @@
+package main
+
+import (
+	"context"
+	"io"
+	"log/slog"
+	"sync/atomic"
+	"time"
+)
+
+const (
+	LogRingSize      = 8192
+	LogDrainInterval = 100 * time.Millisecond
+	LogSampleBurst   = 10
+)
+
+// LevelTrace is below slog.LevelDebug and is used for per-packet records,
+// which are only emitted for the stream selected with Server.SetTrace.
+const LevelTrace = slog.LevelDebug - 4
+
+// ringHandler is a slog.Handler that never formats or writes on the caller's
+// goroutine. Records are pushed into a bounded lock-free ring and a single
+// drain goroutine hands them to the formatting handler. When the ring is full
+// records are dropped and counted rather than blocking the hot path.
+type ringHandler struct {
+	ring  *logRing
+	inner slog.Handler
+	level slog.Leveler
+}
+
+type logCell struct {
+	seq     atomic.Uint64
+	record  slog.Record
+	handler slog.Handler
+}
+
+// logRing is a bounded multi-producer single-consumer queue. Each cell's
+// sequence number tells producers whether the cell is free for the position
+// they claim and tells the consumer whether it has been filled.
+type logRing struct {
+	cells   []logCell
+	mask    uint64
+	tail    atomic.Uint64
+	head    uint64
+	notify  chan struct{}
+	dropped atomic.Int64
+}
+
+// NewLogger returns a logger writing text records to w at level and above.
+func NewLogger(w io.Writer, level slog.Leveler) *slog.Logger {
+	ring := &logRing{
+		cells:  make([]logCell, LogRingSize),
+		mask:   LogRingSize - 1,
+		notify: make(chan struct{}, 1),
+	}
+	for i := range ring.cells {
+		ring.cells[i].seq.Store(uint64(i))
+	}
+
+	inner := slog.NewTextHandler(w, &slog.HandlerOptions{Level: LevelTrace, ReplaceAttr: replaceLevel})
+	go ring.drain(inner)
+
+	return slog.New(&ringHandler{ring: ring, inner: inner, level: level})
+}
+
+func replaceLevel(groups []string, a slog.Attr) slog.Attr {
+	if a.Key == slog.LevelKey && len(groups) == 0 && a.Value.Any() == LevelTrace {
+		a.Value = slog.StringValue("TRACE")
+	}
+	return a
+}
+
+// Enabled lets LevelTrace through regardless of the configured level: trace
+// records are gated per stream by their callers instead.
+func (h *ringHandler) Enabled(_ context.Context, level slog.Level) bool {
+	return level >= h.level.Level() || level == LevelTrace
+}
+
+func (h *ringHandler) Handle(_ context.Context, record slog.Record) error {
+	h.ring.push(record.Clone(), h.inner)
+	return nil
+}
+
+func (h *ringHandler) WithAttrs(attrs []slog.Attr) slog.Handler {
+	return &ringHandler{ring: h.ring, inner: h.inner.WithAttrs(attrs), level: h.level}
+}
+
+func (h *ringHandler) WithGroup(name string) slog.Handler {
+	return &ringHandler{ring: h.ring, inner: h.inner.WithGroup(name), level: h.level}
+}
+
+func (ring *logRing) push(record slog.Record, handler slog.Handler) {
+	for {
+		pos := ring.tail.Load()
+		cell := &ring.cells[pos&ring.mask]
+		seq := cell.seq.Load()
+		if seq == pos {
+			if ring.tail.CompareAndSwap(pos, pos+1) {
+				cell.record = record
+				cell.handler = handler
+				cell.seq.Store(pos + 1)
+				select {
+				case ring.notify <- struct{}{}:
+				default:
+				}
+				return
+			}
+		} else if seq < pos {
+			ring.dropped.Add(1)
+			return
+		}
+	}
+}
+
+func (ring *logRing) drain(inner slog.Handler) {
+	ticker := time.NewTicker(LogDrainInterval)
+	defer ticker.Stop()
+
+	for {
+		select {
+		case <-ring.notify:
+		case <-ticker.C:
+		}
+
+		for {
+			cell := &ring.cells[ring.head&ring.mask]
+			if cell.seq.Load() != ring.head+1 {
+				break
+			}
+			record, handler := cell.record, cell.handler
+			cell.record, cell.handler = slog.Record{}, nil
+			cell.seq.Store(ring.head + ring.mask + 1)
+			ring.head++
+
+			handler.Handle(context.Background(), record)
+		}
+
+		if dropped := ring.dropped.Swap(0); dropped > 0 {
+			record := slog.NewRecord(time.Now(), slog.LevelWarn, "Log ring full, records dropped", 0)
+			record.AddAttrs(slog.Int64("dropped", dropped))
+			inner.Handle(context.Background(), record)
+		}
+	}
+}
+
+// RateLimit lets through at most LogSampleBurst records per second and counts
+// the ones it holds back, so noisy per-packet conditions can be logged per
+// stream without flooding the log.
+type RateLimit struct {
+	second     atomic.Int64
+	count      atomic.Int64
+	suppressed atomic.Int64
+}
+
+// Allow reports whether a record may be logged now and, if so, how many were
+// suppressed since the last one that was.
+func (l *RateLimit) Allow() (bool, int64) {
+	now := time.Now().Unix()
+	if second := l.second.Load(); second != now && l.second.CompareAndSwap(second, now) {
+		l.count.Store(0)
+	}
+	if l.count.Add(1) > LogSampleBurst {
+		l.suppressed.Add(1)
+		return false, 0
+	}
+	return true, l.suppressed.Swap(0)
+}
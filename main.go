@@ -1,23 +1,49 @@
 package main
 
 import (
-	"encoding/base64"
+	"context"
 	"encoding/binary"
-	"encoding/json"
+	"flag"
+	"fmt"
 	"io"
-	"log"
+	"log/slog"
 	"net"
 	"os"
+	"runtime"
 	"sync"
+	"sync/atomic"
+	"time"
 )
 
 const (
-	MaxPacketSize   = 100_000_000
-	DefaultQueueLen = 1024*1024
+	MaxPacketSize = 100_000_000
+	// DefaultQueueLen bounds a stream's ingest queue. The publisher
+	// goroutine only hands packets on by reference, so the queue absorbs
+	// scheduling hiccups rather than media: 4096 packets is over half a
+	// minute of a typical stream, in 32 KiB of pointers.
+	DefaultQueueLen = 4096
+	ViewerQueueLen  = 1024
+	WriterBatch     = 64
 	ListenAddr      = "0.0.0.0:1935"
 	HeaderSize      = 28
 )
 
+// DefaultIdleTimeout is how long a stream without publishers or viewers is
+// kept before its state and goroutines are freed.
+const DefaultIdleTimeout = 30 * time.Second
+
+// A viewer whose backlog reaches ViewerDropThreshold stops receiving the rest
+// of the current GOP; past ViewerSkipThreshold its writer also discards what
+// is already queued up to the next keyframe.
+const (
+	ViewerDropThreshold = ViewerQueueLen / 2
+	ViewerSkipThreshold = ViewerQueueLen * 3 / 4
+)
+
+const DefaultGOPCacheBytes = 8 << 20
+
+const MaxHandshakeSize = 1 << 20
+
 type Header struct {
 	Pts         int64
 	Dts         int64
@@ -29,11 +55,59 @@ type Header struct {
 type Packet struct {
 	Header  Header
 	Payload []byte
+
+	// Head is Header in wire format, encoded once at ingest and shared by
+	// every viewer write.
+	Head [HeaderSize]byte
+
+	// resync is set on the first packet enqueued after the ingest queue
+	// dropped one, so that every viewer waits for the next keyframe.
+	resync bool
+
+	// restart is set on the first packet a publisher session gets onto the
+	// stream's queue, so that the stream's timeline rebases its timestamps.
+	restart bool
+
+	// Seq numbers the packets of a stream in publishing order; viewers only
+	// take packets at or after the sequence number they joined at.
+	Seq uint64
+
+	// refs counts the owners of the packet (ingest, publisher, GOP cache and
+	// viewer queues); the last Release returns it to its size class pool.
+	refs  atomic.Int32
+	class int8
+
+	// gen is the generation of the publisher session that sent the packet.
+	gen uint32
+
+	// chunk is set when Payload points into a publisher's read chunk rather
+	// than a buffer of the packet's own; the packet holds a reference to it.
+	chunk *chunk
+}
+
+func DecodeHeader(b []byte) Header {
+	return Header{
+		Pts:         int64(binary.LittleEndian.Uint64(b[0:8])),
+		Dts:         int64(binary.LittleEndian.Uint64(b[8:16])),
+		StreamIndex: int32(binary.LittleEndian.Uint32(b[16:20])),
+		Flags:       int32(binary.LittleEndian.Uint32(b[20:24])),
+		Size:        int32(binary.LittleEndian.Uint32(b[24:28])),
+	}
 }
 
+func (h *Header) Encode(b []byte) {
+	binary.LittleEndian.PutUint64(b[0:8], uint64(h.Pts))
+	binary.LittleEndian.PutUint64(b[8:16], uint64(h.Dts))
+	binary.LittleEndian.PutUint32(b[16:20], uint32(h.StreamIndex))
+	binary.LittleEndian.PutUint32(b[20:24], uint32(h.Flags))
+	binary.LittleEndian.PutUint32(b[24:28], uint32(h.Size))
+}
+
+func (pkt *Packet) IsVideo() bool    { return pkt.Header.StreamIndex == 0 }
+func (pkt *Packet) IsKeyFrame() bool { return pkt.Header.Flags&1 != 0 }
+
 type State struct {
 	ID           string
-	Clients      map[*Client]bool
 	VideoCodecID int
 	AudioCodecID int
 	FPS          int
@@ -42,45 +116,359 @@ type State struct {
 	VideoExtra   []byte
 	AudioExtra   []byte
 	Mu           sync.RWMutex
-	Queue        chan Packet
+	Queue        chan *Packet
+
+	// shards split the stream's viewers between fan-out workers. The
+	// publisher serves the first shard itself and hands every packet to the
+	// workers of the others by reference. workers lists the shards whose
+	// worker has started; it only grows, under Mu.
+	shards  []*fanoutShard
+	workers []*fanoutShard
+
+	// seq is the sequence number of the last published packet.
+	seq uint64
+
+	// gop holds the packets of the current GOP, starting at its keyframe, so
+	// that a joining viewer can start decoding immediately. The packets are
+	// shared with the viewer queues, not copied. The publisher updates it and
+	// numbers each packet under Mu, and a joining viewer takes the burst and
+	// its starting sequence number under Mu too, so it gets every packet
+	// exactly once, either from the cache or live.
+	gop      []*Packet
+	gopBytes int
+	gopValid bool
+
+	// responses caches the framed pull response, JSON at 0 and binary at 1.
+	// Each is built by the first viewer that needs it and cleared, under Mu,
+	// whenever a publisher changes the codec fields.
+	responses [2][]byte
+
+	// Ingest counters for the metrics endpoint, updated by the publisher's
+	// connection. keyFrameInterval is in nanoseconds.
+	IngestReads      atomic.Int64
+	IngestPackets    atomic.Int64
+	IngestBytes      atomic.Int64
+	IngestDrops      atomic.Int64
+	keyFrameInterval atomic.Int64
+
+	// active is the publisher session that owns the stream, if any, and
+	// sessions counts the sessions opened so far; both are guarded by Mu.
+	// gen is the generation whose packets the publisher goroutine passes
+	// on, and only that goroutine touches it.
+	active   *PushSession
+	sessions uint32
+	gen      uint32
+
+	// users counts the publisher sessions and viewers holding the stream,
+	// and idleSince is when the last of them let go, in Unix nanoseconds.
+	// The registry reaps streams nobody has held for its idle timeout.
+	users     atomic.Int32
+	idleSince atomic.Int64
+
+	// timeline rebases the timestamps of each publisher session onto the
+	// stream's; only the publisher goroutine touches it.
+	timeline timeline
+
+	LogLimit RateLimit
 }
 
 type Server struct {
-	Streams map[string]*State
-	Mu      sync.RWMutex
+	Streams *Registry
+
+	GOPCacheBytes int
+
+	FanoutShards int
+	PinCPUs      bool
+
+	RecordDir      string
+	RecordDirect   bool
+	RecordPrealloc int64
+
+	// IdleTimeout is how long unused streams are kept; 0 keeps them forever.
+	IdleTimeout time.Duration
+
+	LogLevel slog.LevelVar
+	trace    atomic.Pointer[string]
+
+	// Origin is set on edges: streams are pulled from it on first demand, one
+	// upstream connection per stream, instead of being pushed locally.
+	Origin      string
+	upstreamsMu sync.Mutex
+	upstreams   map[string]*upstream
+}
+
+// subscriber is a viewer's entry in a fan-out snapshot. The queue is copied
+// next to the client pointer so the fan-out loop walks one contiguous slice.
+type subscriber struct {
+	Queue    chan *Packet
+	Client   *Client
+	startSeq uint64
 }
 
+// Client is a pull viewer. The publisher only enqueues packet references on
+// Queue; a dedicated writer goroutine drains it, so a slow viewer backs up its
+// own queue instead of stalling the fan-out for everybody else.
 type Client struct {
-	Conn     net.Conn
+	ID            uint64
+	Addr          string
+	Conn          net.Conn
 	FoundKeyFrame bool
-	StreamID string
+	StreamID      string
+	Queue         chan *Packet
+	state         *State
+	shard         int
+	done          chan struct{}
+	closeOnce     sync.Once
+
+	// needParamSet is set when a parameter-set packet could not be queued;
+	// like FoundKeyFrame it belongs to the client's fan-out shard.
+	needParamSet bool
+
+	// skipToKeyFrame asks the writer to discard its backlog up to the next
+	// video keyframe.
+	skipToKeyFrame atomic.Bool
+
+	// wake and onClose are set by the epoll engine, which has no writer
+	// goroutine blocked on Queue: wake schedules a flush on the client's event
+	// loop after packets were queued, onClose closes it there.
+	wake    func()
+	onClose func()
+
+	DroppedPackets atomic.Int64
+	DroppedBytes   atomic.Int64
+	GOPDrops       atomic.Int64
+	KeyFrameSkips  atomic.Int64
+	SentPackets    atomic.Int64
+	SentBytes      atomic.Int64
+	WriteLatency   latencyHistogram
 }
 
+// clientIDs numbers viewers for the metrics endpoint.
+var clientIDs atomic.Uint64
+
 func NewServer() *Server {
 	return &Server{
-		Streams: make(map[string]*State),
-		Mu:      sync.RWMutex{},
+		Streams:       NewRegistry(),
+		GOPCacheBytes: DefaultGOPCacheBytes,
+		FanoutShards:  1,
+		RecordDir:     ".",
+		IdleTimeout:   DefaultIdleTimeout,
+		upstreams:     make(map[string]*upstream),
+	}
+}
+
+func NewState(id string, shards int) *State {
+	state := &State{
+		ID:     id,
+		Queue:  make(chan *Packet, DefaultQueueLen),
+		shards: make([]*fanoutShard, max(shards, 1)),
+	}
+	for i := range state.shards {
+		state.shards[i] = newFanoutShard()
+	}
+	return state
+}
+
+func NewClient(conn net.Conn, streamID string) *Client {
+	client := &Client{
+		ID:       clientIDs.Add(1),
+		Conn:     conn,
+		StreamID: streamID,
+		Queue:    make(chan *Packet, ViewerQueueLen),
+		done:     make(chan struct{}),
+	}
+	if conn != nil {
+		client.Addr = conn.RemoteAddr().String()
+	}
+	return client
+}
+
+// sent counts the packets of batch as written to the client.
+func (client *Client) sent(batch []*Packet) {
+	bytes := 0
+	for _, pkt := range batch {
+		bytes += HeaderSize + len(pkt.Payload)
+	}
+	client.SentPackets.Add(int64(len(batch)))
+	client.SentBytes.Add(int64(bytes))
+}
+
+func (client *Client) drop(pkt *Packet) {
+	client.DroppedPackets.Add(1)
+	client.DroppedBytes.Add(int64(len(pkt.Payload)))
+}
+
+// enqueue applies the per-viewer drop policy and queues a reference to pkt for
+// the writer. It is only called from the goroutine serving the client's
+// fan-out shard, which owns FoundKeyFrame. Video is always dropped in whole
+// GOP tails so the decoder resumes cleanly at a keyframe instead of showing
+// smeared frames.
+func (sub *subscriber) enqueue(pkt *Packet) {
+	client := sub.Client
+	if client.needParamSet {
+		// the viewer must not decode past a publisher change without the
+		// new codec parameters, whatever else it misses
+		ps := client.state.paramSet()
+		select {
+		case sub.Queue <- ps:
+			client.needParamSet = false
+			if client.wake != nil {
+				client.wake()
+			}
+		default:
+			ps.Release()
+			if pkt.IsVideo() {
+				client.FoundKeyFrame = false
+			}
+			client.drop(pkt)
+			return
+		}
+	}
+	if pkt.IsVideo() && !client.FoundKeyFrame {
+		if !pkt.IsKeyFrame() {
+			return
+		}
+		client.FoundKeyFrame = true
+	}
+
+	backlog := len(sub.Queue)
+	if backlog >= ViewerSkipThreshold && !client.skipToKeyFrame.Load() {
+		client.skipToKeyFrame.Store(true)
+		client.KeyFrameSkips.Add(1)
+	}
+
+	if pkt.IsVideo() && !pkt.IsKeyFrame() && backlog >= ViewerDropThreshold {
+		client.FoundKeyFrame = false
+		client.GOPDrops.Add(1)
+		client.drop(pkt)
+		return
+	}
+
+	pkt.Retain()
+	select {
+	case sub.Queue <- pkt:
+		if client.wake != nil {
+			client.wake()
+		}
+	default:
+		pkt.Release()
+		if pkt.IsVideo() {
+			client.FoundKeyFrame = false
+		}
+		if pkt.Header.StreamIndex == ParamSetStreamIndex {
+			client.needParamSet = true
+		}
+		client.drop(pkt)
 	}
 }
 
-func NewState(id string) *State {
-	return &State{
-		ID:      id,
-		Clients: make(map[*Client]bool),
-		Queue:   make(chan Packet, DefaultQueueLen),
+// drain releases whatever is left in the queue of a removed client.
+func (client *Client) drain() {
+	for {
+		select {
+		case pkt := <-client.Queue:
+			pkt.Release()
+		default:
+			return
+		}
 	}
 }
 
+// collect moves queued packets into batch, up to WriterBatch, without
+// blocking.
+func (client *Client) collect(batch []*Packet) []*Packet {
+	for len(batch) < WriterBatch {
+		select {
+		case pkt := <-client.Queue:
+			batch = client.admit(batch, pkt)
+		default:
+			return batch
+		}
+	}
+	return batch
+}
+
+// admit appends pkt to batch unless a pending skip to the next keyframe
+// discards it. Parameter sets are never skipped: the keyframe the skip ends
+// at may need them.
+func (client *Client) admit(batch []*Packet, pkt *Packet) []*Packet {
+	if client.skipToKeyFrame.Load() && pkt.Header.StreamIndex != ParamSetStreamIndex {
+		if !pkt.IsVideo() || !pkt.IsKeyFrame() {
+			client.drop(pkt)
+			pkt.Release()
+			return batch
+		}
+		client.skipToKeyFrame.Store(false)
+	}
+	return append(batch, pkt)
+}
+
+func (client *Client) Close() {
+	client.closeOnce.Do(func() {
+		close(client.done)
+		if client.Conn != nil {
+			client.Conn.Close()
+		}
+		if client.onClose != nil {
+			client.onClose()
+		}
+	})
+}
+
 func main() {
 	server := NewServer()
 
-	ln, err := net.Listen("tcp", ListenAddr)
+	var listenAddr, debugAddr, metricsAddr, traceID, engine string
+	var loops int
+	flag.StringVar(&listenAddr, "listen", ListenAddr, "listen address for push and pull clients")
+	flag.StringVar(&server.Origin, "origin", "", "run as an edge of the relay at this address, pulling streams from it on demand")
+	flag.StringVar(&engine, "engine", "goroutine", "connection engine: goroutine (one goroutine per connection) or epoll (fixed event loops, Linux only)")
+	flag.IntVar(&loops, "loops", runtime.GOMAXPROCS(0), "number of event loops of the epoll engine")
+	flag.IntVar(&server.FanoutShards, "fanout-shards", runtime.GOMAXPROCS(0), "fan-out workers per stream, viewers are spread between them")
+	flag.BoolVar(&server.PinCPUs, "pin-cpus", false, "lock fan-out workers to OS threads bound to CPUs chosen per stream")
+	flag.IntVar(&server.GOPCacheBytes, "gop-cache-bytes", DefaultGOPCacheBytes, "per-stream cap on the GOP cache sent to joining viewers, 0 disables it")
+	flag.StringVar(&server.RecordDir, "record-dir", ".", "directory for stream recordings, empty disables recording")
+	flag.BoolVar(&server.RecordDirect, "record-direct", false, "write recordings with O_DIRECT")
+	flag.Int64Var(&server.RecordPrealloc, "record-prealloc", 0, "bytes to preallocate for each recording")
+	flag.DurationVar(&server.IdleTimeout, "idle-timeout", DefaultIdleTimeout, "free streams that have had no publisher or viewer for this long, 0 keeps them forever")
+	flag.Func("log-level", "minimum level of log records: DEBUG, INFO, WARN or ERROR (default INFO)", func(level string) error {
+		return server.LogLevel.UnmarshalText([]byte(level))
+	})
+	flag.StringVar(&debugAddr, "debug-addr", DefaultDebugAddr, "listen address of the debug endpoint, empty disables it")
+	flag.StringVar(&metricsAddr, "metrics-addr", DefaultMetricsAddr, "listen address of the Prometheus metrics endpoint, empty disables it")
+	flag.StringVar(&traceID, "trace", "", "stream_id whose packets are traced from startup")
+	flag.Parse()
+
+	slog.SetDefault(NewLogger(os.Stderr, &server.LogLevel))
+	server.SetTrace(traceID)
+	if debugAddr != "" {
+		go server.serveDebug(debugAddr)
+	}
+	if metricsAddr != "" {
+		go server.serveMetrics(metricsAddr)
+	}
+	if server.IdleTimeout > 0 {
+		go server.reaper()
+	}
+
+	switch engine {
+	case "goroutine":
+	case "epoll":
+		if err := server.serveReactor(listenAddr, loops); err != nil {
+			panic(err)
+		}
+		return
+	default:
+		panic(fmt.Sprintf("unknown engine %q", engine))
+	}
+
+	ln, err := net.Listen("tcp", listenAddr)
 	if err != nil {
 		panic(err)
 	}
 	defer ln.Close()
 
-	log.Println("Server listening on", ListenAddr)
+	slog.Info("Server listening", "addr", listenAddr, "origin", server.Origin)
 	for {
 		conn, err := ln.Accept()
 		if err != nil {
@@ -93,300 +481,552 @@ func main() {
 func handleConnection(conn net.Conn, server *Server) {
 	defer conn.Close()
 
-	var length uint32
-	if err := binary.Read(conn, binary.LittleEndian, &length); err != nil {
+	prefix := make([]byte, 8)
+	if _, err := io.ReadFull(conn, prefix[:4]); err != nil {
 		return
 	}
+	if binary.LittleEndian.Uint32(prefix) == HandshakeMagic {
+		if _, err := io.ReadFull(conn, prefix[4:]); err != nil {
+			return
+		}
+	}
 
-	payload := make([]byte, length)
-	if _, err := io.ReadFull(conn, payload); err != nil {
+	_, length, binaryFrame, err := handshakeFrame(prefix)
+	if err != nil {
+		slog.Warn("Invalid input", "err", err, "addr", conn.RemoteAddr().String())
 		return
 	}
 
-	var header map[string]any
-	if err := json.Unmarshal(payload, &header); err != nil {
-		log.Println("Invalid JSON header:", err)
+	payload := make([]byte, length)
+	if _, err := io.ReadFull(conn, payload); err != nil {
 		return
 	}
 
-	mode, ok := header["mode"].(string)
-	if !ok {
-		log.Println("Invalid input, missing mode")
+	handshake, err := parseHandshake(payload, binaryFrame)
+	if err != nil {
+		slog.Warn("Invalid handshake", "err", err)
 		return
 	}
 
-	switch mode {
+	switch handshake.Mode {
 	case "push":
-		handlePush(conn, header, server)
+		handlePush(conn, handshake, server)
 	case "pull":
-		handlePull(conn, header, server)
+		handlePull(conn, handshake, server)
 	default:
-		log.Printf("Invalid input, mode %s is not supported", mode)
+		slog.Warn("Invalid input, mode is not supported", "mode", handshake.Mode)
 	}
 }
 
-func handlePush(conn net.Conn, header map[string]any, server *Server) {
-	streamID, ok := header["stream_id"].(string)
-	if !ok {
-		log.Println("Invalid input, missing stream_id")
-		return
-	}
+// PushSession is a connected publisher: its stream state, its recording and
+// the ingest bookkeeping shared by both connection engines.
+type PushSession struct {
+	server    *Server
+	StreamID  string
+	State     *State
+	handshake *Handshake
 
-	videoCodecID, ok := header["video_codec_id"].(float64)
-	if !ok {
-		log.Println("Invalid input, missing video_codec_id")
-		return
-	}
+	// gen numbers the stream's publisher sessions; the publisher goroutine
+	// only passes on packets of the session that took over last.
+	gen uint32
 
-	audioCodecID, ok := header["audio_codec_id"].(float64)
-	if !ok {
-		log.Println("Invalid input, missing audio_codec_id")
-		return
+	// staged is set while the session waits for its first video keyframe to
+	// take the stream over from the publisher that had it. announce asks for
+	// a parameter-set packet ahead of the session's next packet. superseded
+	// is set once another session has taken the stream over.
+	staged     bool
+	announce   bool
+	superseded atomic.Bool
+
+	// stop makes the connection engine close the session's connection; it
+	// may be called from any goroutine.
+	stop func()
+
+	// recordHandshake is the framed handshake a recording of the session
+	// starts with, nil if the session is not recorded. The recording is only
+	// opened once the session is the stream's active publisher.
+	recordHandshake []byte
+	record          *Recorder
+
+	dropped bool
+	// queued is set once a packet of the session made it onto the queue
+	queued bool
+
+	// lastKeyFrame is when the publisher last sent a video keyframe.
+	lastKeyFrame time.Time
+}
+
+// openPush registers a publisher for the handshake's stream and, if record is
+// set and recording is enabled, records it once it is the stream's active
+// publisher. A stream without a live publisher takes the handshake's codec
+// parameters at once; otherwise the session is staged until it takes over at
+// its first keyframe. stop closes the session's connection when another
+// publisher takes over.
+func (server *Server) openPush(h *Handshake, record bool, stop func()) (*PushSession, error) {
+	session := &PushSession{server: server, StreamID: h.StreamID, handshake: h, stop: stop}
+
+	if record && server.RecordDir != "" {
+		handshake, err := h.Encode()
+		if err != nil {
+			return nil, fmt.Errorf("cannot marshal push header: %w", err)
+		}
+		session.recordHandshake = handshake
 	}
 
-	fps, ok := header["fps"].(float64)
-	if !ok {
-		log.Println("Invalid input, missing fps")
-		return
+	state := server.stream(h.StreamID)
+	state.Mu.Lock()
+	state.sessions++
+	session.gen = state.sessions
+	if state.active == nil {
+		state.setCodec(h)
+		state.active = session
+		// viewers left over from an earlier publisher learn the new
+		// parameters in band
+		session.announce = session.gen > 1
+	} else {
+		session.staged = true
 	}
+	state.Mu.Unlock()
+	session.State = state
 
-	width, ok := header["width"].(float64)
-	if !ok {
-		log.Println("Invalid input, missing width")
-		return
+	slog.Info("Push client connected", "stream_id", h.StreamID, "video_codec_id", h.VideoCodecID, "audio_codec_id", h.AudioCodecID,
+		"fps", h.FPS, "binary", h.Binary, "video_extradata", len(h.VideoExtra), "audio_extradata", len(h.AudioExtra),
+		"staged", session.staged)
+	if !session.staged {
+		session.startRecording()
 	}
+	return session, nil
+}
 
-	height, ok := header["height"].(float64)
-	if !ok {
-		log.Println("Invalid input, missing height")
-		return
+// Ingest hands a packet read from the publisher to the recording and the
+// stream's publisher goroutine. It never blocks and takes over the caller's
+// reference to packet. Packets of a staged or superseded session go to
+// neither.
+func (session *PushSession) Ingest(packet *Packet) {
+	state := session.State
+	if session.server.tracing(session.StreamID) {
+		logPacket(session.StreamID, packet)
 	}
 
-	var videoExtraData []byte
-	if encoded, ok := header["video_extradata"].(string); ok && encoded != "" {
-		var err error
-		videoExtraData, err = base64.StdEncoding.DecodeString(encoded)
-		if err != nil {
-			log.Println("Failed to decode video_extradata:", err)
-			return
+	state.IngestPackets.Add(1)
+	state.IngestBytes.Add(int64(len(packet.Payload)))
+	if packet.IsVideo() && packet.IsKeyFrame() {
+		now := time.Now()
+		if !session.lastKeyFrame.IsZero() {
+			state.keyFrameInterval.Store(int64(now.Sub(session.lastKeyFrame)))
 		}
+		session.lastKeyFrame = now
 	}
 
-	var audioExtraData []byte
-	if encoded, ok := header["audio_extradata"].(string); ok && encoded != "" {
-		var err error
-		audioExtraData, err = base64.StdEncoding.DecodeString(encoded)
-		if err != nil {
-			log.Println("Failed to decode audio_extradata:", err)
+	if session.staged {
+		if !packet.IsVideo() || !packet.IsKeyFrame() {
+			packet.Release()
 			return
 		}
+		session.takeOver()
 	}
-
-	file, err := os.Create(streamID)
-	if err != nil {
-		log.Println("ERROR: cannot create file:", err)
+	if session.superseded.Load() {
+		packet.Release()
 		return
 	}
-	defer file.Close()
+	if session.record != nil {
+		session.record.Write(packet)
+	}
+	if packet.Header.StreamIndex == ParamSetStreamIndex {
+		// an origin announcing new parameters to an edge
+		if err := state.applyParamSet(packet.Payload); err != nil {
+			slog.Warn("Invalid parameter set", "stream_id", session.StreamID, "err", err)
+		}
+	}
+	if session.announce {
+		session.announce = false
+		session.enqueue(state.paramSet())
+	}
+	session.enqueue(packet)
+}
 
-	server.Mu.Lock()
-	state, ok := server.Streams[streamID]
-	if !ok {
-		state = NewState(streamID)
-		server.Streams[streamID] = state
-		go server.publisher(state)
+func (session *PushSession) enqueue(packet *Packet) {
+	state := session.State
+	packet.resync = session.dropped
+	packet.restart = !session.queued
+	packet.gen = session.gen
+	select {
+	case state.Queue <- packet:
+		session.dropped = false
+		session.queued = true
+	default:
+		session.dropped = session.dropped || packet.IsVideo()
+		packet.Release()
+		state.IngestDrops.Add(1)
+		if ok, suppressed := state.LogLimit.Allow(); ok {
+			slog.Warn("Dropping packet, queue full", "stream_id", session.StreamID, "suppressed", suppressed)
+		}
 	}
-	state.VideoCodecID = int(videoCodecID)
-	state.AudioCodecID = int(audioCodecID)
-	state.FPS = int(fps)
-	state.Width = int(width)
-	state.Height = int(height)
-	state.VideoExtra = videoExtraData
-	state.AudioExtra = audioExtraData
-	server.Mu.Unlock()
+}
 
-	log.Printf(
-		"Push client connected, streamID=%s, videoCodecID=%d, audioCodecID=%d, fps=%d, video_extradata=%d bytes, audio_extradata=%d bytes",
-		streamID, int(videoCodecID), int(audioCodecID), int(fps), len(videoExtraData), len(audioExtraData),
-	)
+// Superseded reports whether another publisher has taken the stream over,
+// in which case the connection should be closed.
+func (session *PushSession) Superseded() bool {
+	return session.superseded.Load()
+}
 
-	for {
-		bytes := make([]byte, HeaderSize)
-		if _, err := io.ReadFull(conn, bytes); err != nil {
-			log.Printf("Push client disconnected, streamID: %s", streamID)
-			break
-		}
+func (session *PushSession) Close() {
+	state := session.State
+	state.Mu.Lock()
+	if state.active == session {
+		state.active = nil
+	}
+	state.Mu.Unlock()
+	session.server.Streams.Release(state)
 
-		h := Header{
-			Pts:         int64(binary.LittleEndian.Uint64(bytes[0:8])),
-			Dts:         int64(binary.LittleEndian.Uint64(bytes[8:16])),
-			StreamIndex: int32(binary.LittleEndian.Uint32(bytes[16:20])),
-			Flags:       int32(binary.LittleEndian.Uint32(bytes[20:24])),
-			Size:        int32(binary.LittleEndian.Uint32(bytes[24:28])),
-		}
+	slog.Info("Push client disconnected", "stream_id", session.StreamID, "superseded", session.Superseded())
+	if session.record != nil {
+		session.record.Close()
+	}
+}
 
-		if h.Size < 0 || h.Size > MaxPacketSize {
-			log.Printf("Invalid packet size: %d, disconnecting client %s", h.Size, conn.RemoteAddr().String())
-			break
-		}
+func handlePush(conn net.Conn, handshake *Handshake, server *Server) {
+	session, err := server.openPush(handshake, true, func() { interruptRead(conn) })
+	if err != nil {
+		slog.Warn("Invalid push request", "err", err)
+		return
+	}
+	defer session.Close()
 
-		payload := make([]byte, h.Size)
-		if _, err := io.ReadFull(conn, payload); err != nil {
-			log.Printf("Push client disconnected, streamID: %s", streamID)
-			break
-		}
+	session.ReadPackets(conn)
+}
 
-		packet := Packet{Header: h, Payload: payload}
-		logPacket(packet)
+// interruptRead makes a blocked or future Read on conn fail at once.
+func interruptRead(conn net.Conn) {
+	conn.SetReadDeadline(time.Unix(1, 0))
+}
 
-		if packet.Header.StreamIndex == 0 {
-			if _, err := file.Write(packet.Payload); err != nil {
-				log.Println("ERROR: cannot write packet:", err)
+// ReadPackets ingests packets framed as in a push connection until conn fails,
+// sends an invalid header or another publisher takes the stream over.
+func (session *PushSession) ReadPackets(conn net.Conn) {
+	var in ingestBuffer
+	defer in.Close()
+	for {
+		n, err := conn.Read(in.space())
+		if n > 0 {
+			session.State.IngestReads.Add(1)
+			if err := in.commit(n, session); err != nil {
+				slog.Warn("Invalid packet, disconnecting client", "err", err, "addr", conn.RemoteAddr().String())
+				return
+			}
+			if session.Superseded() {
+				return
 			}
 		}
-
-		state.Mu.RLock()
-		select {
-		case state.Queue <- packet:
-		default:
-			log.Printf("Dropping packet for stream %s, queue full", streamID)
+		if err != nil {
+			return
 		}
-		state.Mu.RUnlock()
 	}
 }
 
-func handlePull(conn net.Conn, header map[string]any, server *Server) {
-	streamID, ok := header["stream_id"].(string)
-	if !ok {
-		log.Println("Invalid input, missing stream_id")
-		return
+// openPull returns the state of the stream a pull handshake asks for and the
+// framed response to send before any packet, in the handshake's encoding. On
+// an edge it may block until the stream has been pulled from the origin.
+func (server *Server) openPull(h *Handshake) (*State, []byte, error) {
+	var state *State
+	if server.Origin != "" {
+		var err error
+		if state, err = server.originStream(h.StreamID); err != nil {
+			return nil, nil, err
+		}
+	} else {
+		state = server.Streams.Acquire(h.StreamID)
 	}
-
-	server.Mu.RLock()
-	state, ok := server.Streams[streamID]
-	server.Mu.RUnlock()
-	if !ok {
-		log.Println("Pull client requested unknown stream:", streamID)
-		return
+	if state == nil {
+		return nil, nil, fmt.Errorf("unknown stream %q", h.StreamID)
 	}
 
-	resp := map[string]any{
-		"stream_id":      streamID,
-		"video_codec_id": state.VideoCodecID,
-		"audio_codec_id": state.AudioCodecID,
-		"fps":            state.FPS,
-		"height":         state.Height,
-		"width":          state.Width,
+	framed, err := state.pullResponse(h.Binary)
+	if err != nil {
+		server.Streams.Release(state)
+		return nil, nil, fmt.Errorf("cannot marshal pull response: %w", err)
 	}
 
-	if len(state.VideoExtra) > 0 {
-		resp["video_extradata"] = base64.StdEncoding.EncodeToString(state.VideoExtra)
+	slog.Info("Pull client connected", "stream_id", state.ID, "binary", h.Binary, "response", len(framed))
+	return state, framed, nil
+}
+
+// pullResponse returns the cached pull response in the requested encoding,
+// building it if a publisher changed the codec fields since the last one.
+// The returned slice is shared and must not be modified.
+func (state *State) pullResponse(binaryFrame bool) ([]byte, error) {
+	i := 0
+	if binaryFrame {
+		i = 1
 	}
 
-	if len(state.AudioExtra) > 0 {
-		resp["audio_extradata"] = base64.StdEncoding.EncodeToString(state.AudioExtra)
+	state.Mu.RLock()
+	framed := state.responses[i]
+	state.Mu.RUnlock()
+	if framed != nil {
+		return framed, nil
 	}
 
-	data, err := json.Marshal(resp)
-	if err != nil {
-		log.Println("Failed to marshal pull response:", err)
-		return
+	state.Mu.Lock()
+	defer state.Mu.Unlock()
+	if state.responses[i] == nil {
+		var err error
+		if state.responses[i], err = state.codec(binaryFrame).Encode(); err != nil {
+			return nil, err
+		}
 	}
+	return state.responses[i], nil
+}
 
-	length := uint32(len(data))
-	if err := binary.Write(conn, binary.LittleEndian, length); err != nil {
-		log.Println("Failed to write pull response length:", err)
+func handlePull(conn net.Conn, handshake *Handshake, server *Server) {
+	state, resp, err := server.openPull(handshake)
+	if err != nil {
+		slog.Warn("Invalid pull request", "err", err)
 		return
 	}
 
-	if _, err := conn.Write(data); err != nil {
-		log.Println("Failed to write pull response data:", err)
+	if _, err := conn.Write(resp); err != nil {
+		slog.Warn("Failed to write pull response", "err", err)
+		server.Streams.Release(state)
 		return
 	}
 
-	log.Printf("Pull client connected, streamID=%s, videoCodecID=%d, audioCodecID=%d, fps=%d, video_extradata=%d bytes, audio_extradata=%d bytes",
-		streamID, state.VideoCodecID, state.AudioCodecID, state.FPS, len(state.VideoExtra), len(state.AudioExtra))
-
-	client := &Client{Conn: conn, FoundKeyFrame: false, StreamID: streamID}
-	server.addClient(client)
-	defer server.removeClient(client, streamID)
+	client := NewClient(conn, state.ID)
+	server.addClient(client, state)
+	defer server.removeClient(client)
+	go server.writer(client)
 
 	buf := make([]byte, 1)
 	for {
 		if _, err := conn.Read(buf); err != nil {
-			log.Printf("Pull client disconnected, streamID: %s", streamID)
 			return
 		}
 	}
 }
 
-func (server *Server) addClient(client *Client) {
-	server.Mu.Lock()
-	state, ok := server.Streams[client.StreamID]
-	if !ok {
-		state = NewState(client.StreamID)
-		server.Streams[client.StreamID] = state
+// stream returns the state of streamID, creating it and starting its
+// goroutines if needed, with a reference the caller must give back with
+// Streams.Release.
+func (server *Server) stream(streamID string) *State {
+	state, created := server.Streams.AcquireOrCreate(streamID, func(id string) *State {
+		return NewState(id, server.FanoutShards)
+	})
+	if created {
 		go server.publisher(state)
 	}
+	return state
+}
+
+// reaper frees the streams that have been unused for IdleTimeout. Closing a
+// stream's queue ends its publisher goroutine, which stops the fan-out
+// workers and drops the GOP cache on its way out.
+func (server *Server) reaper() {
+	ticker := time.NewTicker(max(server.IdleTimeout/4, time.Second))
+	defer ticker.Stop()
+	for range ticker.C {
+		for _, state := range server.Streams.Reap(server.IdleTimeout) {
+			close(state.Queue)
+			slog.Info("Stream freed", "stream_id", state.ID)
+		}
+	}
+}
+
+// addClient subscribes client to state, taking over the caller's reference
+// to state; removeClient gives it back.
+func (server *Server) addClient(client *Client, state *State) {
+	client.state = state
 	state.Mu.Lock()
-	state.Clients[client] = true
+	state.burst(client)
+	client.shard = state.leastLoadedShard()
+	server.startWorker(state, client.shard)
+	shard := state.shards[client.shard]
+	old := *shard.Clients.Load()
+	subs := make([]subscriber, len(old), len(old)+1)
+	copy(subs, old)
+	subs = append(subs, subscriber{Queue: client.Queue, Client: client, startSeq: state.seq + 1})
+	shard.Clients.Store(&subs)
 	state.Mu.Unlock()
-	server.Mu.Unlock()
 }
 
-func (server *Server) removeClient(client *Client, streamID string) {
-	server.Mu.Lock()
-	state, ok := server.Streams[streamID]
-	if ok {
-		state.Mu.Lock()
-		delete(state.Clients, client)
-		state.Mu.Unlock()
+func (server *Server) removeClient(client *Client) {
+	state := client.state
+	state.Mu.Lock()
+	shard := state.shards[client.shard]
+	old := *shard.Clients.Load()
+	subs := make([]subscriber, 0, len(old))
+	for _, sub := range old {
+		if sub.Client != client {
+			subs = append(subs, sub)
+		}
+	}
+	shard.Clients.Store(&subs)
+	state.Mu.Unlock()
+	server.Streams.Release(state)
+
+	client.Close()
+	client.drain()
+
+	slog.Info("Pull client disconnected", "stream_id", client.StreamID, "dropped_packets", client.DroppedPackets.Load(),
+		"dropped_bytes", client.DroppedBytes.Load(), "gop_drops", client.GOPDrops.Load(), "keyframe_skips", client.KeyFrameSkips.Load())
+}
+
+// publishPackets sends the header and payload of every packet in batch with
+// a single vectored write. bufs is scratch space owned by the caller.
+func (server *Server) publishPackets(batch []*Packet, bufs net.Buffers, client *Client) (net.Buffers, error) {
+	bufs = bufs[:0]
+	for _, pkt := range batch {
+		bufs = append(bufs, pkt.Head[:], pkt.Payload)
+	}
+	if len(bufs) == 0 {
+		return bufs, nil
+	}
+	w := bufs
+	_, err := w.WriteTo(client.Conn)
+	return bufs, err
+}
+
+// writer drains the client's queue onto its connection, taking whatever
+// backlog is queued (up to WriterBatch packets) into one write. A failed write
+// closes the connection, which ends the keepalive loop in handlePull and
+// removes the client from its stream.
+func (server *Server) writer(client *Client) {
+	batch := make([]*Packet, 0, WriterBatch)
+	bufs := make(net.Buffers, 0, 2*WriterBatch)
+	for {
+		select {
+		case pkt := <-client.Queue:
+			batch = client.admit(batch, pkt)
+		case <-client.done:
+			return
+		}
+		batch = client.collect(batch)
+
+		start := time.Now()
+		var err error
+		bufs, err = server.publishPackets(batch, bufs, client)
+		client.WriteLatency.Observe(time.Since(start))
+		if err == nil {
+			client.sent(batch)
+		}
+		for _, pkt := range batch {
+			pkt.Release()
+		}
+		clear(batch)
+		batch = batch[:0]
+		if err != nil {
+			slog.Info("Failed to send packet to client", "stream_id", client.StreamID, "err", err)
+			client.Close()
+			return
+		}
 	}
-	server.Mu.Unlock()
-	client.Conn.Close()
 }
 
-func (server *Server) publishPacket(pkt Packet, client *Client) error {
-	header := make([]byte, HeaderSize)
-	binary.LittleEndian.PutUint64(header[0:8], uint64(pkt.Header.Pts))
-	binary.LittleEndian.PutUint64(header[8:16], uint64(pkt.Header.Dts))
-	binary.LittleEndian.PutUint32(header[16:20], uint32(pkt.Header.StreamIndex))
-	binary.LittleEndian.PutUint32(header[20:24], uint32(pkt.Header.Flags))
-	binary.LittleEndian.PutUint32(header[24:28], uint32(pkt.Header.Size))
+// cache keeps pkt in the current GOP. A keyframe starts a new GOP; a GOP that
+// lost a video packet at ingest, grew past limit or belongs to a publisher
+// that has since been replaced is not cached.
+func (state *State) cache(pkt *Packet, limit int) {
+	if pkt.IsVideo() && pkt.IsKeyFrame() {
+		state.resetCache()
+		state.gopValid = true
+	} else if pkt.resync || pkt.restart {
+		state.resetCache()
+	}
+
+	if !state.gopValid {
+		return
+	}
 
-	if _, err := client.Conn.Write(header); err != nil {
-		return err
+	if state.gopBytes+len(pkt.Payload) > limit {
+		state.resetCache()
+		return
 	}
-	if _, err := client.Conn.Write(pkt.Payload); err != nil {
-		return err
+
+	pkt.Retain()
+	state.gop = append(state.gop, pkt)
+	state.gopBytes += len(pkt.Payload)
+}
+
+func (state *State) resetCache() {
+	for _, pkt := range state.gop {
+		pkt.Release()
 	}
-	return nil
+	clear(state.gop)
+	state.gop = state.gop[:0]
+	state.gopBytes = 0
+	state.gopValid = false
 }
 
+// burst queues the cached GOP on a joining client so it does not have to wait
+// for the next keyframe. A GOP that would put the client past its drop
+// threshold is skipped and the client waits for the keyframe as before.
+func (state *State) burst(client *Client) {
+	if !state.gopValid || len(state.gop) == 0 || len(state.gop) >= ViewerDropThreshold {
+		return
+	}
+	for _, pkt := range state.gop {
+		pkt.Retain()
+		client.Queue <- pkt
+	}
+	client.FoundKeyFrame = true
+	if client.wake != nil {
+		client.wake()
+	}
+}
+
+// publisher normalises the timestamps of each packet, numbers it, hands it to
+// the fan-out workers and fans it out to the first shard itself. It never
+// blocks on a viewer: lagging viewers shed load through their own drop
+// policy. Only the cache update and the numbering happen under Mu; the
+// fan-out itself runs without any lock, so joins and leaves never wait for
+// it.
 func (server *Server) publisher(state *State) {
+	if server.PinCPUs {
+		pinThread(state.ID, 0)
+	}
+	defer func() {
+		state.Mu.Lock()
+		for _, shard := range state.workers {
+			close(shard.queue)
+		}
+		state.resetCache()
+		state.Mu.Unlock()
+	}()
+
 	for pkt := range state.Queue {
-		state.Mu.RLock()
-		for client := range state.Clients {
-			if pkt.Header.StreamIndex == 0 && !client.FoundKeyFrame {
-				if pkt.Header.Flags&1 == 0 {
-					continue
-				}
-				client.FoundKeyFrame = true
-			}
+		// a session's first packet switches the stream over to it; late
+		// packets of the session it superseded are dropped
+		if pkt.restart {
+			state.gen = pkt.gen
+		} else if pkt.gen != state.gen {
+			pkt.Release()
+			continue
+		}
+		state.timeline.normalize(pkt)
 
-			if err := server.publishPacket(pkt, client); err != nil {
-				log.Printf("Failed to send packet to client: %v", err)
-			}
+		state.Mu.Lock()
+		if server.GOPCacheBytes > 0 {
+			state.cache(pkt, server.GOPCacheBytes)
+		}
+		state.seq++
+		pkt.Seq = state.seq
+		workers := state.workers
+		state.Mu.Unlock()
+
+		for _, shard := range workers {
+			pkt.Retain()
+			shard.queue <- pkt
 		}
-		state.Mu.RUnlock()
+		state.shards[0].fanout(pkt)
+		pkt.Release()
 	}
 }
 
-func logPacket(packet Packet) {
-	log.Printf("Packet: Pts=%d Dts=%d StreamIndex=%d Flags=%d Size=%d",
-		packet.Header.Pts,
-		packet.Header.Dts,
-		packet.Header.StreamIndex,
-		packet.Header.Flags,
-		packet.Header.Size)
+func logPacket(streamID string, packet *Packet) {
+	slog.LogAttrs(context.Background(), LevelTrace, "Packet",
+		slog.String("stream_id", streamID),
+		slog.Int64("pts", packet.Header.Pts),
+		slog.Int64("dts", packet.Header.Dts),
+		slog.Int("stream_index", int(packet.Header.StreamIndex)),
+		slog.Int("flags", int(packet.Header.Flags)),
+		slog.Int("size", int(packet.Header.Size)))
 }
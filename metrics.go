@@ -0,0 +1,163 @@
+package main
+
+import (
+	"bufio"
+	"fmt"
+	"log/slog"
+	"net/http"
+	"strconv"
+	"strings"
+	"sync/atomic"
+	"time"
+)
+
+const DefaultMetricsAddr = "127.0.0.1:9935"
+
+// writeBuckets are the upper bounds, in seconds, of the viewer write latency
+// histogram.
+var writeBuckets = [...]float64{0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1}
+
+// latencyHistogram is a Prometheus histogram updated with atomics only.
+// counts[i] counts observations that fall in bucket i alone; the cumulative
+// counts are summed when the histogram is exported.
+type latencyHistogram struct {
+	counts   [len(writeBuckets) + 1]atomic.Int64
+	sumNanos atomic.Int64
+}
+
+func (h *latencyHistogram) Observe(d time.Duration) {
+	seconds := d.Seconds()
+	i := 0
+	for i < len(writeBuckets) && seconds > writeBuckets[i] {
+		i++
+	}
+	h.counts[i].Add(1)
+	h.sumNanos.Add(int64(d))
+}
+
+// serveMetrics exports stream and viewer statistics in the Prometheus text
+// format on /metrics, on a listener of its own. Nothing is computed on the
+// hot path beyond atomic counter updates: rates such as the ingest bitrate
+// and packets per second are left to rate() over the counters.
+func (server *Server) serveMetrics(addr string) {
+	mux := http.NewServeMux()
+	mux.HandleFunc("/metrics", server.handleMetrics)
+
+	slog.Info("Metrics endpoint listening", "addr", addr)
+	if err := http.ListenAndServe(addr, mux); err != nil {
+		slog.Error("Metrics endpoint stopped", "addr", addr, "err", err)
+	}
+}
+
+func (server *Server) handleMetrics(w http.ResponseWriter, r *http.Request) {
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+	m := &metricsWriter{w: bufio.NewWriter(w)}
+
+	var states []*State
+	server.Streams.Range(func(state *State) {
+		states = append(states, state)
+	})
+
+	m.family("sfu_stream_ingest_reads_total", "counter", "Reads from the stream's publisher connection.")
+	for _, s := range states {
+		m.sample("sfu_stream_ingest_reads_total", streamLabels(s), s.IngestReads.Load())
+	}
+	m.family("sfu_stream_ingest_packets_total", "counter", "Packets received from the stream's publisher.")
+	for _, s := range states {
+		m.sample("sfu_stream_ingest_packets_total", streamLabels(s), s.IngestPackets.Load())
+	}
+	m.family("sfu_stream_ingest_bytes_total", "counter", "Payload bytes received from the stream's publisher.")
+	for _, s := range states {
+		m.sample("sfu_stream_ingest_bytes_total", streamLabels(s), s.IngestBytes.Load())
+	}
+	m.family("sfu_stream_ingest_dropped_packets_total", "counter", "Packets dropped because the stream's queue was full.")
+	for _, s := range states {
+		m.sample("sfu_stream_ingest_dropped_packets_total", streamLabels(s), s.IngestDrops.Load())
+	}
+	m.family("sfu_stream_keyframe_interval_seconds", "gauge", "Time between the last two video keyframes received.")
+	for _, s := range states {
+		m.sample("sfu_stream_keyframe_interval_seconds", streamLabels(s), float64(s.keyFrameInterval.Load())/1e9)
+	}
+	m.family("sfu_stream_queue_depth", "gauge", "Packets waiting in the stream's queue for its publisher goroutine.")
+	for _, s := range states {
+		m.sample("sfu_stream_queue_depth", streamLabels(s), len(s.Queue))
+	}
+	m.family("sfu_stream_viewers", "gauge", "Viewers attached to the stream.")
+	for _, s := range states {
+		m.sample("sfu_stream_viewers", streamLabels(s), s.viewers())
+	}
+
+	var clients []*Client
+	for _, s := range states {
+		for _, shard := range s.shards {
+			for _, sub := range *shard.Clients.Load() {
+				clients = append(clients, sub.Client)
+			}
+		}
+	}
+
+	for _, counter := range []struct {
+		name, help string
+		value      func(*Client) int64
+	}{
+		{"sfu_viewer_sent_packets_total", "Packets written to the viewer.", func(c *Client) int64 { return c.SentPackets.Load() }},
+		{"sfu_viewer_sent_bytes_total", "Bytes written to the viewer.", func(c *Client) int64 { return c.SentBytes.Load() }},
+		{"sfu_viewer_dropped_packets_total", "Packets dropped for the viewer.", func(c *Client) int64 { return c.DroppedPackets.Load() }},
+		{"sfu_viewer_dropped_bytes_total", "Payload bytes dropped for the viewer.", func(c *Client) int64 { return c.DroppedBytes.Load() }},
+		{"sfu_viewer_gop_drops_total", "GOP tails dropped because the viewer's backlog was too long.", func(c *Client) int64 { return c.GOPDrops.Load() }},
+		{"sfu_viewer_keyframe_skips_total", "Times the viewer's backlog was discarded up to the next keyframe.", func(c *Client) int64 { return c.KeyFrameSkips.Load() }},
+	} {
+		m.family(counter.name, "counter", counter.help)
+		for _, c := range clients {
+			m.sample(counter.name, viewerLabels(c), counter.value(c))
+		}
+	}
+
+	m.family("sfu_viewer_backlog_packets", "gauge", "Packets queued for the viewer and not written yet.")
+	for _, c := range clients {
+		m.sample("sfu_viewer_backlog_packets", viewerLabels(c), len(c.Queue))
+	}
+
+	m.family("sfu_viewer_write_seconds", "histogram", "Time spent in each write of a batch of packets to the viewer.")
+	for _, c := range clients {
+		labels := viewerLabels(c)
+		var cumulative int64
+		for i, le := range writeBuckets {
+			cumulative += c.WriteLatency.counts[i].Load()
+			m.sample("sfu_viewer_write_seconds_bucket", labels+`,le="`+strconv.FormatFloat(le, 'g', -1, 64)+`"`, cumulative)
+		}
+		cumulative += c.WriteLatency.counts[len(writeBuckets)].Load()
+		m.sample("sfu_viewer_write_seconds_bucket", labels+`,le="+Inf"`, cumulative)
+		m.sample("sfu_viewer_write_seconds_sum", labels, float64(c.WriteLatency.sumNanos.Load())/1e9)
+		m.sample("sfu_viewer_write_seconds_count", labels, cumulative)
+	}
+
+	m.w.Flush()
+}
+
+type metricsWriter struct {
+	w *bufio.Writer
+}
+
+func (m *metricsWriter) family(name, typ, help string) {
+	fmt.Fprintf(m.w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, typ)
+}
+
+func (m *metricsWriter) sample(name, labels string, value any) {
+	fmt.Fprintf(m.w, "%s{%s} %v\n", name, labels, value)
+}
+
+func streamLabels(state *State) string {
+	return `stream_id="` + escapeLabel(state.ID) + `"`
+}
+
+func viewerLabels(client *Client) string {
+	return `stream_id="` + escapeLabel(client.StreamID) + `",viewer="` + strconv.FormatUint(client.ID, 10) +
+		`",addr="` + escapeLabel(client.Addr) + `"`
+}
+
+var labelEscaper = strings.NewReplacer(`\`, `\\`, `"`, `\"`, "\n", `\n`)
+
+func escapeLabel(value string) string {
+	return labelEscaper.Replace(value)
+}
@@ -0,0 +1,82 @@
+package main
+
+import (
+	"math/bits"
+	"sync"
+)
+
+// Packets are pooled by payload size class: class i holds packets whose
+// payload buffer has a capacity of 1<<(MinPacketShift+i) bytes. Payloads larger
+// than the biggest class are allocated on demand and left to the GC.
+const (
+	MinPacketShift   = 10
+	MaxPacketShift   = 24
+	PacketClassCount = MaxPacketShift - MinPacketShift + 1
+)
+
+var packetPools [PacketClassCount]sync.Pool
+
+func packetClass(size int) int {
+	if size <= 1<<MinPacketShift {
+		return 0
+	}
+	class := bits.Len(uint(size-1)) - MinPacketShift
+	if class >= PacketClassCount {
+		return -1
+	}
+	return class
+}
+
+// NewPacket returns a packet with a payload of h.Size bytes and one reference,
+// owned by the caller. The payload contents are undefined.
+func NewPacket(h Header) *Packet {
+	size := int(h.Size)
+	class := packetClass(size)
+
+	var pkt *Packet
+	if class >= 0 {
+		if v := packetPools[class].Get(); v != nil {
+			pkt = v.(*Packet)
+		} else {
+			pkt = &Packet{Payload: make([]byte, 0, 1<<(MinPacketShift+class))}
+		}
+	} else {
+		pkt = &Packet{Payload: make([]byte, 0, size)}
+	}
+
+	pkt.Header = h
+	pkt.Header.Encode(pkt.Head[:])
+	pkt.Payload = pkt.Payload[:size]
+	pkt.class = int8(class)
+	pkt.resync = false
+	pkt.restart = false
+	pkt.refs.Store(1)
+	return pkt
+}
+
+// Retain adds a reference for a new owner, typically a viewer queue.
+func (pkt *Packet) Retain() {
+	pkt.refs.Add(1)
+}
+
+// Release drops one reference. The last one returns the packet and its
+// payload to the pool, after which neither may be touched.
+func (pkt *Packet) Release() {
+	refs := pkt.refs.Add(-1)
+	if refs > 0 {
+		return
+	}
+	if refs < 0 {
+		panic("sfu: packet released more times than retained")
+	}
+	if pkt.chunk != nil {
+		pkt.chunk.Release()
+		pkt.chunk = nil
+		pkt.Payload = nil
+		chunkPacketPool.Put(pkt)
+		return
+	}
+	if pkt.class >= 0 {
+		packetPools[pkt.class].Put(pkt)
+	}
+}
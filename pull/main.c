@@ -4,6 +4,7 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <unistd.h>
@@ -20,15 +21,198 @@
 #define W 480*2
 #define H 270*2
 
+// set by the relay on the first packet of a stream after it rebased the
+// timestamps of a reconnected publisher; not an AV_PKT_FLAG_* bit
+#define FLAG_DISCONTINUITY (1 << 16)
+
+// packets of this stream index carry a binary pull response with the
+// stream's new codec parameters, sent when another publisher takes over
+#define PARAM_SET_STREAM_INDEX -1
+#define PARAM_SET_MAGIC 0x42554653 // "SFUB"
+
 char *json_get_string(const char *json, const char *key);
 int64_t json_get_int(const char *json, const char *key, int64_t def);
 int64_t json_get_int(const char *json, const char *key, int64_t def);
 ssize_t read_exact(int fd, void *buf, size_t len);
 void *keep_alive_thread(void *arg);
 void *reader_thread(void *arg);
+void *decode_thread(void *arg);
+static uint32_t read_le32(const uint8_t *p);
+
+// PullStats accumulates what a headless session measured since the last
+// report. Lag is how much later than its PTS implies a frame was decoded,
+// relative to the earliest frame so far: the relay forwards the publisher's
+// timestamps, not wall-clock capture times, so this is the glass-to-glass
+// latency above the best case seen rather than an absolute figure.
+typedef struct {
+    int64_t frames;
+    int64_t decode_us, decode_max_us;
+    int64_t sws_us, sws_max_us;
+    int64_t queue_sum, queue_max;
+    int64_t lag_us, lag_max_us;
+} PullStats;
+
+// The render loop presents each frame at its timestamp plus a target latency
+// on the local monotonic clock. The target follows the measured arrival
+// jitter, so a steady network gets low latency and a bursty one a deeper
+// buffer instead of stalls.
+#define JITTER_FACTOR 3               // target = JITTER_FACTOR * jitter + one frame
+#define JITTER_MIN_TARGET_US 20000
+#define JITTER_MAX_TARGET_US 1000000
+#define JITTER_TARGET_SMOOTHING 32    // the target moves 1/32 of the way per presented frame
+#define JITTER_BASE_DRIFT 512         // transit base creeps up 1/512 per packet
+
+// Packets wait in a queue of PACKET_QUEUE_LEN between the reader thread and
+// the decoder; when it is full the reader stops reading and TCP pushes back
+// on the relay, which drops for slow viewers, instead of the client
+// buffering without bound.
+#define PACKET_QUEUE_LEN 1024
+
+// Payloads are copied out of a receive buffer filled by bulk reads into
+// pooled, ref-counted buffers of a few size classes, padded and zeroed as
+// the decoder requires. Payloads above the largest class get a buffer of
+// their own, and those of at least RECV_DIRECT_SIZE bytes are read straight
+// into it instead of through the receive buffer.
+#define RECV_BUFFER_SIZE (256 << 10)
+#define RECV_DIRECT_SIZE (RECV_BUFFER_SIZE / 4)
+#define PACKET_CLASSES 3
+static const int packet_class_sizes[PACKET_CLASSES] = {4 << 10, 64 << 10, 1 << 20};
+
+// Decoded frames travel from the decode thread to the render loop through a
+// bounded queue. They come from a fixed pool, so the decoder waits when
+// presentation falls FRAME_POOL_SIZE frames behind instead of allocating.
+#define FRAME_POOL_SIZE 8
+
+// JitterClock maps packet timestamps to the local monotonic clock. The reader
+// thread feeds it the arrival of every video packet; the render loop asks it
+// when a packet is due. Timestamps are DTS, which grows monotonically in
+// decode order, falling back to PTS.
+typedef struct {
+    pthread_mutex_t mu;
+    AVRational time_base;
+    int64_t frame_us;        // one tick of time_base, the frame interval
+    bool started;
+    int64_t base_us;         // smallest recent transit, arrival minus timestamp
+    int64_t last_transit_us;
+    double jitter_us;        // RFC 3550 interarrival jitter
+    double target_us;
+} JitterClock;
+
+// YuvRenderer draws YUV 4:2:0 frames without converting them on the CPU: the
+// three planes are uploaded as single-channel textures, 1.5 bytes per pixel
+// instead of 4 for RGBA, and a fragment shader turns them into RGB while
+// scaling to the window, as yuv_renderer_render does on Android. Textures are
+// as wide as the planes' strides so that rows upload without repacking; the
+// shader crops and maps chroma coordinates accordingly.
+typedef struct {
+    Shader shader;
+    int loc_tex_u, loc_tex_v, loc_chroma_scale, loc_full_range;
+    Texture2D tex_y, tex_u, tex_v;
+    int width, height;
+    float chroma_scale[2];
+    int full_range;
+} YuvRenderer;
+
+static const char *yuv_fragment_shader =
+    "#version 330\n"
+    "in vec2 fragTexCoord;\n"
+    "out vec4 finalColor;\n"
+    "uniform sampler2D texture0;\n" // Y
+    "uniform sampler2D texU;\n"
+    "uniform sampler2D texV;\n"
+    "uniform vec2 chromaScale;\n"
+    "uniform int fullRange;\n"
+    "void main() {\n"
+    "    vec2 c = fragTexCoord * chromaScale;\n"
+    "    float y = texture(texture0, fragTexCoord).r;\n"
+    "    float u = texture(texU, c).r - 0.5;\n"
+    "    float v = texture(texV, c).r - 0.5;\n"
+    "    if (fullRange == 0) {\n"
+    "        y = (y - 16.0 / 255.0) * (255.0 / 219.0);\n"
+    "        u *= 255.0 / 224.0;\n"
+    "        v *= 255.0 / 224.0;\n"
+    "    }\n"
+    "    finalColor = vec4(y + 1.402 * v, y - 0.344136 * u - 0.714136 * v, y + 1.772 * u, 1.0);\n"
+    "}\n";
+
+// yuv_renderer_open compiles the conversion shader. It fails when the shader
+// does not build, and the caller falls back to converting with swscale.
+int yuv_renderer_open(YuvRenderer *r) {
+    memset(r, 0, sizeof(*r));
+    r->shader = LoadShaderFromMemory(NULL, yuv_fragment_shader);
+    r->loc_tex_u = GetShaderLocation(r->shader, "texU");
+    r->loc_tex_v = GetShaderLocation(r->shader, "texV");
+    r->loc_chroma_scale = GetShaderLocation(r->shader, "chromaScale");
+    r->loc_full_range = GetShaderLocation(r->shader, "fullRange");
+    // raylib substitutes its default shader for one that fails to build
+    if (r->loc_tex_u < 0 || r->loc_tex_v < 0) {
+        UnloadShader(r->shader);
+        memset(r, 0, sizeof(*r));
+        return -1;
+    }
+    return 0;
+}
+
+static Texture2D load_plane_texture(int width, int height) {
+    Image img = {.data = NULL, .width = width, .height = height, .mipmaps = 1, .format = PIXELFORMAT_UNCOMPRESSED_GRAYSCALE};
+    Texture2D texture = LoadTextureFromImage(img);
+    SetTextureFilter(texture, TEXTURE_FILTER_BILINEAR);
+    SetTextureWrap(texture, TEXTURE_WRAP_CLAMP);
+    return texture;
+}
+
+static void unload_plane_texture(Texture2D *texture) {
+    if (texture->id) UnloadTexture(*texture);
+    memset(texture, 0, sizeof(*texture));
+}
+
+// yuv_renderer_upload uploads the planes of frame. It fails for frames the
+// shader cannot draw, which are then converted with swscale.
+int yuv_renderer_upload(YuvRenderer *r, const AVFrame *frame) {
+    if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P) return -1;
+    if (frame->linesize[0] <= 0 || frame->linesize[1] <= 0 || frame->linesize[1] != frame->linesize[2]) return -1;
+
+    int chroma_height = (frame->height + 1) / 2;
+    if (r->tex_y.width != frame->linesize[0] || r->tex_y.height != frame->height || r->tex_u.width != frame->linesize[1] || r->tex_u.height != chroma_height) {
+        unload_plane_texture(&r->tex_y);
+        unload_plane_texture(&r->tex_u);
+        unload_plane_texture(&r->tex_v);
+        r->tex_y = load_plane_texture(frame->linesize[0], frame->height);
+        r->tex_u = load_plane_texture(frame->linesize[1], chroma_height);
+        r->tex_v = load_plane_texture(frame->linesize[2], chroma_height);
+    }
+
+    UpdateTexture(r->tex_y, frame->data[0]);
+    UpdateTexture(r->tex_u, frame->data[1]);
+    UpdateTexture(r->tex_v, frame->data[2]);
+
+    r->width = frame->width;
+    r->height = frame->height;
+    r->chroma_scale[0] = (float)frame->linesize[0] / (2.0f * frame->linesize[1]);
+    r->chroma_scale[1] = (float)frame->height / (2.0f * chroma_height);
+    r->full_range = frame->format == AV_PIX_FMT_YUVJ420P;
+    return 0;
+}
+
+// yuv_renderer_draw draws the last uploaded frame scaled to width x height.
+// It must be called between BeginDrawing and EndDrawing.
+void yuv_renderer_draw(YuvRenderer *r, int width, int height) {
+    BeginShaderMode(r->shader);
+    SetShaderValueTexture(r->shader, r->loc_tex_u, r->tex_u);
+    SetShaderValueTexture(r->shader, r->loc_tex_v, r->tex_v);
+    SetShaderValue(r->shader, r->loc_chroma_scale, r->chroma_scale, SHADER_UNIFORM_VEC2);
+    SetShaderValue(r->shader, r->loc_full_range, &r->full_range, SHADER_UNIFORM_INT);
+    DrawTexturePro(r->tex_y, (Rectangle){0, 0, r->width, r->height}, (Rectangle){0, 0, width, height}, (Vector2){0, 0}, 0, WHITE);
+    EndShaderMode();
+}
 
 typedef struct {
     int fd;
+    // reader thread only: bytes [recv_r, recv_w) of recv_buf are read and
+    // not consumed yet
+    uint8_t *recv_buf;
+    size_t recv_r, recv_w;
+    AVBufferPool *packet_pools[PACKET_CLASSES];
     AVCodecContext *decoder;
     AVFrame *frame;
     AVFrame *rgb_frame;
@@ -36,16 +220,51 @@ typedef struct {
     bool keep_alive_running;
     bool reader_running;
     AVThreadMessageQueue *queue;
+    AVThreadMessageQueue *free_packets;
+    JitterClock clock;
+
+    // windowed sessions only: the decode thread takes empty frames from
+    // free_frames and hands them decoded to the render loop through frames
+    AVThreadMessageQueue *frames;
+    AVThreadMessageQueue *free_frames;
+
+    // render loop only: the next frame, held back until it is due
+    AVFrame *pending;
+    SwsContext *display_sws;
+    bool yuv_enabled; // the YUV shader works and was not disabled
+    bool yuv_shown;   // the last frame presented went through it
+    YuvRenderer yuv;
+    int64_t presented, dropped;
+    // upload cost of the frames presented since report_us, for comparing
+    // the YUV and RGBA paths
+    int64_t upload_frames, upload_us, upload_max_us, report_us;
 
     const char *stream_id;
     const char *ip;
     int16_t port;
+
+    // headless sessions only
+    bool convert;
+    pthread_mutex_t stats_mu;
+    PullStats stats;
+    int64_t min_offset_us;
+    bool have_offset;
 } MediaPull;
 
 int media_pull_init(MediaPull *ctx) {
     ctx->keep_alive_running = true;
     ctx->reader_running = true;
-    av_thread_message_queue_alloc(&ctx->queue, 1024*1024, sizeof(AVPacket *));
+    pthread_mutex_init(&ctx->stats_mu, NULL);
+    pthread_mutex_init(&ctx->clock.mu, NULL);
+    ctx->clock.target_us = JITTER_MIN_TARGET_US;
+    if (av_thread_message_queue_alloc(&ctx->queue, PACKET_QUEUE_LEN, sizeof(AVPacket *)) < 0) return -1;
+    if (av_thread_message_queue_alloc(&ctx->free_packets, PACKET_QUEUE_LEN, sizeof(AVPacket *)) < 0) return -1;
+    for (int i = 0; i < PACKET_CLASSES; i++) {
+        ctx->packet_pools[i] = av_buffer_pool_init(packet_class_sizes[i] + AV_INPUT_BUFFER_PADDING_SIZE, NULL);
+        if (!ctx->packet_pools[i]) return -1;
+    }
+    ctx->recv_buf = av_malloc(RECV_BUFFER_SIZE);
+    if (!ctx->recv_buf) return -1;
 
     //av_log_set_level(AV_LOG_TRACE);
 
@@ -60,94 +279,473 @@ int media_pull_init(MediaPull *ctx) {
     return 0;
 }
 
-int media_pull_decode_render(MediaPull *ctx, Texture texture, int width, int height) {
+// media_pull_get_packet returns an empty packet whose buffer has room for
+// size bytes and zeroed padding after them.
+static AVPacket *media_pull_get_packet(MediaPull *ctx, int size) {
     AVPacket *pkt = NULL;
-    if (av_thread_message_queue_recv(ctx->queue, &pkt, AV_THREAD_MESSAGE_NONBLOCK) < 0 || pkt->stream_index != 0) {
-        BeginDrawing();
-        DrawTexture(texture, 0, 0, WHITE);
-        EndDrawing();
+    if (av_thread_message_queue_recv(ctx->free_packets, &pkt, AV_THREAD_MESSAGE_NONBLOCK) < 0) {
+        pkt = av_packet_alloc();
+        if (!pkt) return NULL;
+    }
+
+    for (int i = 0; i < PACKET_CLASSES && !pkt->buf; i++) {
+        if (size <= packet_class_sizes[i]) pkt->buf = av_buffer_pool_get(ctx->packet_pools[i]);
+    }
+    if (!pkt->buf) pkt->buf = av_buffer_alloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!pkt->buf) {
         av_packet_free(&pkt);
+        return NULL;
+    }
+    pkt->data = pkt->buf->data;
+    pkt->size = size;
+    memset(pkt->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return pkt;
+}
+
+// media_pull_put_packet returns a packet the decoder is done with, and its
+// buffer, to their pools.
+static void media_pull_put_packet(MediaPull *ctx, AVPacket **pkt) {
+    av_packet_unref(*pkt);
+    if (av_thread_message_queue_send(ctx->free_packets, pkt, AV_THREAD_MESSAGE_NONBLOCK) < 0) av_packet_free(pkt);
+    *pkt = NULL;
+}
+
+// media_pull_start_decoding starts the decode thread of a windowed session
+// and fills its frame pool.
+int media_pull_start_decoding(MediaPull *ctx) {
+    if (av_thread_message_queue_alloc(&ctx->frames, FRAME_POOL_SIZE, sizeof(AVFrame *)) < 0) return -1;
+    if (av_thread_message_queue_alloc(&ctx->free_frames, FRAME_POOL_SIZE, sizeof(AVFrame *)) < 0) return -1;
+    for (int i = 0; i < FRAME_POOL_SIZE; i++) {
+        AVFrame *frame = av_frame_alloc();
+        if (!frame) return -1;
+        av_thread_message_queue_send(ctx->free_frames, &frame, 0);
+    }
+
+    pthread_t tid_decode;
+    pthread_create(&tid_decode, NULL, decode_thread, ctx);
+    pthread_detach(tid_decode);
+    return 0;
+}
+
+// open_decoder opens decoder with FFmpeg's frame and slice threading on as
+// many threads as there are cores.
+static int open_decoder(AVCodecContext *decoder, const AVCodec *codec) {
+    decoder->thread_count = 0;
+    decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    return avcodec_open2(decoder, codec, NULL);
+}
+
+void jitter_clock_set_time_base(JitterClock *c, AVRational time_base) {
+    pthread_mutex_lock(&c->mu);
+    c->time_base = time_base;
+    c->frame_us = av_rescale_q(1, time_base, AV_TIME_BASE_Q);
+    c->started = false;
+    pthread_mutex_unlock(&c->mu);
+}
+
+// jitter_clock_arrive accounts for a video packet with timestamp ts arriving
+// at now. A discontinuity restarts the transit base, keeping the jitter.
+void jitter_clock_arrive(JitterClock *c, int64_t ts, int64_t now, bool discontinuity) {
+    if (ts == AV_NOPTS_VALUE) return;
+    pthread_mutex_lock(&c->mu);
+    if (c->time_base.num == 0) {
+        // the handshake has not told the stream's time base yet
+        pthread_mutex_unlock(&c->mu);
+        return;
+    }
+    int64_t transit = now - av_rescale_q(ts, c->time_base, AV_TIME_BASE_Q);
+    if (!c->started || discontinuity) {
+        c->base_us = transit;
+        c->started = true;
+    } else {
+        int64_t d = transit - c->last_transit_us;
+        c->jitter_us += (llabs(d) - c->jitter_us) / 16;
+        if (transit < c->base_us) {
+            c->base_us = transit;
+        } else {
+            c->base_us += (transit - c->base_us) / JITTER_BASE_DRIFT;
+        }
+    }
+    c->last_transit_us = transit;
+    pthread_mutex_unlock(&c->mu);
+}
+
+// jitter_clock_due returns when a frame with timestamp ts should be presented
+// and the frame interval. Everything it needs is the clock's own, so it can be
+// called before the reader thread has connected and opened the decoder; until
+// the first arrival it returns INT64_MIN.
+int64_t jitter_clock_due(JitterClock *c, int64_t ts, int64_t *frame_us) {
+    pthread_mutex_lock(&c->mu);
+    *frame_us = c->frame_us;
+    int64_t due = INT64_MIN;
+    if (c->started && ts != AV_NOPTS_VALUE) {
+        due = av_rescale_q(ts, c->time_base, AV_TIME_BASE_Q) + c->base_us + (int64_t)c->target_us;
+    }
+    pthread_mutex_unlock(&c->mu);
+    return due;
+}
+
+// jitter_clock_presented moves the target latency towards what the jitter
+// calls for. It is called once per presented frame, so the target follows the
+// stream's frame rate rather than the display's refresh rate.
+void jitter_clock_presented(JitterClock *c) {
+    pthread_mutex_lock(&c->mu);
+    double want = FFMIN(FFMAX(JITTER_FACTOR * c->jitter_us + c->frame_us, JITTER_MIN_TARGET_US), JITTER_MAX_TARGET_US);
+    c->target_us += (want - c->target_us) / JITTER_TARGET_SMOOTHING;
+    pthread_mutex_unlock(&c->mu);
+}
+
+// jitter_clock_stats returns the clock's current target latency and jitter.
+void jitter_clock_stats(JitterClock *c, double *target_us, double *jitter_us) {
+    pthread_mutex_lock(&c->mu);
+    *target_us = c->target_us;
+    *jitter_us = c->jitter_us;
+    pthread_mutex_unlock(&c->mu);
+}
+
+// media_pull_apply_params reopens the decoder when a parameter-set packet
+// changes the video codec or its extradata, so the viewer keeps its
+// connection when a new publisher takes the stream over.
+int media_pull_apply_params(MediaPull *ctx, const uint8_t *data, int size) {
+    if (size < 8 + 24 || read_le32(data) != PARAM_SET_MAGIC || read_le32(data + 4) > (uint32_t)size - 8) {
+        fprintf(stderr, "WARN: invalid parameter set of %d bytes\n", size);
         return 0;
     }
 
-    int ret = avcodec_send_packet(ctx->decoder, pkt);
+    const uint8_t *body = data + 8;
+    uint32_t length = read_le32(data + 4);
+    uint32_t video_codec_id = read_le32(body + 4);
+    uint32_t fps = read_le32(body + 12);
+    if (fps == 0) fps = 30;
+    jitter_clock_set_time_base(&ctx->clock, (AVRational){1, fps});
+
+    const uint8_t *extradata = NULL;
+    uint32_t extradata_size = 0;
+    for (uint32_t off = 24; off + 6 <= length;) {
+        uint16_t type = body[off] | body[off + 1] << 8;
+        uint32_t len = read_le32(body + off + 2);
+        off += 6;
+        if (len > length - off) break;
+        if (type == 2) {
+            extradata = body + off;
+            extradata_size = len;
+        }
+        off += len;
+    }
+
+    if (ctx->decoder->codec_id == (enum AVCodecID)video_codec_id && ctx->decoder->extradata_size == (int)extradata_size &&
+        (extradata_size == 0 || memcmp(ctx->decoder->extradata, extradata, extradata_size) == 0)) {
+        printf("Parameter set unchanged\n");
+        return 0;
+    }
+
+    const AVCodec *codec = avcodec_find_decoder(video_codec_id);
+    if (!codec) {
+        fprintf(stderr, "ERROR: cannot find decoder %s\n", avcodec_get_name(video_codec_id));
+        return -1;
+    }
+
+    AVCodecContext *decoder = avcodec_alloc_context3(codec);
+    decoder->time_base = (AVRational){1, fps};
+    decoder->framerate = (AVRational){fps, 1};
+    if (extradata_size > 0) {
+        decoder->extradata = av_mallocz(extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        memcpy(decoder->extradata, extradata, extradata_size);
+        decoder->extradata_size = extradata_size;
+    }
+    int ret = open_decoder(decoder, codec);
     if (ret < 0) {
-        fprintf(stderr, "ERROR: cannot send packet to decoder. %s\n", av_err2str(ret));
+        fprintf(stderr, "ERROR: cannot open decoder. %s\n", av_err2str(ret));
+        avcodec_free_context(&decoder);
         return -1;
     }
 
-    while (ret >= 0) {
-        ret = avcodec_receive_frame(ctx->decoder, ctx->frame);
-        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) {
-            break;
-        } else if (ret < 0) {
-            fprintf(stderr, "ERROR: cannot receive frame from decoder...\n");
-            return -1;
+    avcodec_free_context(&ctx->decoder);
+    ctx->decoder = decoder;
+    sws_freeContext(ctx->sws_ctx);
+    ctx->sws_ctx = NULL;
 
-        }
-        if (!ctx->sws_ctx) {
-            ctx->sws_ctx = sws_getContext(ctx->frame->width, ctx->frame->height, ctx->frame->format, width, height, AV_PIX_FMT_RGBA, SWS_BILINEAR, NULL, NULL, NULL);
+    printf("Decoder reopened: codec=%s fps=%u extradata=%u\n", avcodec_get_name(video_codec_id), fps, extradata_size);
+    return 0;
+}
+
+// decode_thread decodes a windowed session's packets into frames from the
+// pool and queues them for the render loop, so a slow frame delays the
+// pipeline by its own decode time instead of stalling the window. Packets
+// only arrive once the reader thread has opened the decoder.
+void *decode_thread(void *arg) {
+    MediaPull *ctx = (MediaPull *)arg;
+    AVPacket *pkt = NULL;
+    while (av_thread_message_queue_recv(ctx->queue, &pkt, 0) >= 0) {
+        if (pkt->stream_index != 0) {
+            int ret = 0;
+            if (pkt->stream_index == PARAM_SET_STREAM_INDEX) ret = media_pull_apply_params(ctx, pkt->data, pkt->size);
+            media_pull_put_packet(ctx, &pkt);
+            if (ret < 0) break;
+            continue;
         }
 
-        int64_t pkt_pts = pkt->pts;
-        int64_t pkt_dts = pkt->dts;
-        int64_t frame_pts = ctx->frame->pts;
-        int64_t frame_pts_ms = av_rescale_q(frame_pts, ctx->decoder->time_base, (AVRational){1, 1000});
+        int ret = avcodec_send_packet(ctx->decoder, pkt);
+        if (ret < 0) fprintf(stderr, "ERROR: cannot send packet to decoder. %s\n", av_err2str(ret));
+        media_pull_put_packet(ctx, &pkt);
+
+        while (ret >= 0) {
+            AVFrame *frame = NULL;
+            if (av_thread_message_queue_recv(ctx->free_frames, &frame, 0) < 0) goto done;
+            ret = avcodec_receive_frame(ctx->decoder, frame);
+            if (ret < 0) {
+                av_thread_message_queue_send(ctx->free_frames, &frame, 0);
+                if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+                    fprintf(stderr, "ERROR: cannot receive frame from decoder. %s\n", av_err2str(ret));
+                }
+                break;
+            }
+            av_thread_message_queue_send(ctx->frames, &frame, 0);
+        }
+    }
 
-        static bool go_fast = false;
-        static bool go_super_fast = false;
+done:
+    fprintf(stderr, "ERROR: session %s stopped decoding\n", ctx->stream_id);
+    av_thread_message_queue_set_err_recv(ctx->frames, AVERROR_EOF);
+    return NULL;
+}
 
-        const int upper_threshold = 2;       // start going fast if queue >= 3
-        const int lower_threshold = 1;       // go slow again if queue <= 1
-        const int super_threshold = 4;       // start going super fast if queue >= 10
-        const int super_lower_threshold = 3; // stop super fast if queue <= 8
+// recycle_frame returns a frame the render loop is done with to the pool.
+static void recycle_frame(MediaPull *ctx, AVFrame *frame) {
+    av_frame_unref(frame);
+    av_thread_message_queue_send(ctx->free_frames, &frame, 0);
+}
 
-        int queue_len = av_thread_message_queue_nb_elems(ctx->queue);
+// media_pull_render presents the last decoded frame that is due on the
+// stream's clock, then draws. It never sleeps: the window's target frame
+// rate paces the loop. A frame more than a frame late is skipped when the
+// next one is already decoded, so a viewer that fell behind catches up.
+int media_pull_render(MediaPull *ctx, Texture texture, int width, int height) {
+    while (ctx->pending || av_thread_message_queue_recv(ctx->frames, &ctx->pending, AV_THREAD_MESSAGE_NONBLOCK) >= 0) {
+        AVFrame *frame = ctx->pending;
+        int64_t now = av_gettime_relative(), frame_us;
+        int64_t due = jitter_clock_due(&ctx->clock, frame->best_effort_timestamp, &frame_us);
+        if (due > now) break;
+        ctx->pending = NULL;
+
+        // a frame the clock cannot place yet is presented at once
+        int64_t late_us = due == INT64_MIN ? 0 : now - due;
+        if (late_us > frame_us && av_thread_message_queue_nb_elems(ctx->frames) > 0) {
+            ctx->dropped++;
+            recycle_frame(ctx, frame);
+            continue;
+        }
 
-        if (!go_super_fast && queue_len >= super_threshold) {
-            go_super_fast = true;
-        } else if (go_super_fast && queue_len <= super_lower_threshold) {
-            go_super_fast = false;
+        int64_t start = av_gettime_relative();
+        ctx->yuv_shown = ctx->yuv_enabled && yuv_renderer_upload(&ctx->yuv, frame) >= 0;
+        if (!ctx->yuv_shown) {
+            ctx->display_sws = sws_getCachedContext(ctx->display_sws, frame->width, frame->height, frame->format, width, height, AV_PIX_FMT_RGBA, SWS_BILINEAR, NULL, NULL, NULL);
+            sws_scale_frame(ctx->display_sws, ctx->rgb_frame, frame);
+            UpdateTexture(texture, ctx->rgb_frame->data[0]);
         }
+        int64_t upload_us = av_gettime_relative() - start;
+        ctx->presented++;
+        jitter_clock_presented(&ctx->clock);
+        ctx->upload_frames++;
+        ctx->upload_us += upload_us;
+        ctx->upload_max_us = FFMAX(ctx->upload_max_us, upload_us);
+
+        double target_us, jitter_us;
+        jitter_clock_stats(&ctx->clock, &target_us, &jitter_us);
+        printf("Frame: pts=%" PRId64 " width=%d height=%d format=%s key_frame=%d | late=%.1f ms target=%.1f ms jitter=%.1f ms upload=%.2f ms presented=%" PRId64 " dropped=%" PRId64 " frames=%d packets=%d\n",
+               frame->pts, frame->width, frame->height, av_get_pix_fmt_name(frame->format), !!(frame->flags & AV_FRAME_FLAG_KEY),
+               late_us / 1e3, target_us / 1e3, jitter_us / 1e3, upload_us / 1e3, ctx->presented, ctx->dropped,
+               av_thread_message_queue_nb_elems(ctx->frames), av_thread_message_queue_nb_elems(ctx->queue));
+        recycle_frame(ctx, frame);
+        break;
+    }
 
-        if (!go_fast && queue_len >= upper_threshold && !go_super_fast) {
-            go_fast = true;
-        } else if (go_fast && queue_len <= lower_threshold) {
-            go_fast = false;
+    BeginDrawing();
+    if (ctx->yuv_shown) {
+        yuv_renderer_draw(&ctx->yuv, width, height);
+    } else {
+        DrawTexture(texture, 0, 0, WHITE);
+    }
+    EndDrawing();
+
+    int64_t now = av_gettime_relative();
+    if (now - ctx->report_us >= 1000000) {
+        double frames = ctx->upload_frames ? (double)ctx->upload_frames : 1;
+        printf("Present: path=%s fps=%d frames=%" PRId64 " upload_ms avg=%.2f max=%.2f\n", ctx->yuv_shown ? "yuv" : "rgba", GetFPS(),
+               ctx->upload_frames, ctx->upload_us / frames / 1e3, ctx->upload_max_us / 1e3);
+        ctx->upload_frames = ctx->upload_us = ctx->upload_max_us = 0;
+        ctx->report_us = now;
+    }
+    return 0;
+}
+
+// media_pull_decode decodes the next packet without presenting it, converts
+// its frames to RGBA if ctx->convert is set and accounts the time spent in
+// ctx->stats. It blocks until a packet arrives.
+int media_pull_decode(MediaPull *ctx) {
+    AVPacket *pkt = NULL;
+    if (av_thread_message_queue_recv(ctx->queue, &pkt, 0) < 0) return -1;
+    int64_t queue_len = av_thread_message_queue_nb_elems(ctx->queue);
+
+    if (pkt->stream_index != 0) {
+        int ret = 0;
+        if (pkt->stream_index == PARAM_SET_STREAM_INDEX) ret = media_pull_apply_params(ctx, pkt->data, pkt->size);
+        media_pull_put_packet(ctx, &pkt);
+        return ret;
+    }
+
+    int64_t start = av_gettime_relative();
+    int ret = avcodec_send_packet(ctx->decoder, pkt);
+    media_pull_put_packet(ctx, &pkt);
+    if (ret < 0) {
+        fprintf(stderr, "ERROR: cannot send packet to decoder. %s\n", av_err2str(ret));
+        return -1;
+    }
+
+    for (;;) {
+        ret = avcodec_receive_frame(ctx->decoder, ctx->frame);
+        if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) return 0;
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: cannot receive frame from decoder. %s\n", av_err2str(ret));
+            return -1;
+        }
+        int64_t decoded = av_gettime_relative();
+
+        int64_t sws_us = 0;
+        if (ctx->convert) {
+            if (!ctx->sws_ctx) {
+                ctx->sws_ctx = sws_getContext(ctx->frame->width, ctx->frame->height, ctx->frame->format, ctx->frame->width, ctx->frame->height, AV_PIX_FMT_RGBA, SWS_BILINEAR, NULL, NULL, NULL);
+                av_frame_unref(ctx->rgb_frame);
+                ctx->rgb_frame->format = AV_PIX_FMT_RGBA;
+                ctx->rgb_frame->width = ctx->frame->width;
+                ctx->rgb_frame->height = ctx->frame->height;
+            }
+            sws_scale_frame(ctx->sws_ctx, ctx->rgb_frame, ctx->frame);
+            sws_us = av_gettime_relative() - decoded;
         }
 
-        int64_t sleep_us = 1e6 * ctx->decoder->framerate.den / ctx->decoder->framerate.num;
+        int64_t lag_us = -1;
+        if (ctx->frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+            int64_t offset = decoded - av_rescale_q(ctx->frame->best_effort_timestamp, ctx->decoder->time_base, AV_TIME_BASE_Q);
+            if (!ctx->have_offset || offset < ctx->min_offset_us) {
+                ctx->min_offset_us = offset;
+                ctx->have_offset = true;
+            }
+            lag_us = offset - ctx->min_offset_us;
+        }
 
-        if (go_super_fast) {
-            sleep_us *= 0; // 4x speed
-        } else if (go_fast) {
-            sleep_us *= 0.7; // 2x speed
+        pthread_mutex_lock(&ctx->stats_mu);
+        PullStats *st = &ctx->stats;
+        st->frames++;
+        st->decode_us += decoded - start;
+        st->decode_max_us = FFMAX(st->decode_max_us, decoded - start);
+        st->sws_us += sws_us;
+        st->sws_max_us = FFMAX(st->sws_max_us, sws_us);
+        st->queue_sum += queue_len;
+        st->queue_max = FFMAX(st->queue_max, queue_len);
+        if (lag_us >= 0) {
+            st->lag_us += lag_us;
+            st->lag_max_us = FFMAX(st->lag_max_us, lag_us);
         }
+        pthread_mutex_unlock(&ctx->stats_mu);
 
-        av_usleep(sleep_us);
+        // further frames of the same packet cost only their own receive
+        start = av_gettime_relative();
+    }
+}
 
-        printf("Packet: pts=%" PRId64 " dts=%" PRId64 " size=%d | Frame: pts=%" PRId64 " ms=%" PRId64 " width=%d height=%d format=%s key_frame=%d | Sleeping: %" PRId64 " ms Queue Size: %d\n", pkt_pts, pkt_dts, pkt->size, frame_pts, frame_pts_ms, ctx->frame->width, ctx->frame->height, av_get_pix_fmt_name(ctx->frame->format), ctx->frame->flags & AV_FRAME_FLAG_KEY, sleep_us / 1000,
-               av_thread_message_queue_nb_elems(ctx->queue));
+void *headless_thread(void *arg) {
+    MediaPull *ctx = (MediaPull *)arg;
+    while (media_pull_decode(ctx) >= 0) {
+    }
+    fprintf(stderr, "ERROR: session %s stopped decoding\n", ctx->stream_id);
+    return NULL;
+}
 
-        sws_scale_frame(ctx->sws_ctx, ctx->rgb_frame, ctx->frame);
-        UpdateTexture(texture, ctx->rgb_frame->data[0]);
-        BeginDrawing();
-        DrawTexture(texture, 0, 0, WHITE);
-        EndDrawing();
+// report prints the stats of all sessions since the last report, over
+// interval_us, and resets them. It returns the frames decoded.
+int64_t report(MediaPull *sessions, int n, int64_t elapsed_s, int64_t interval_us) {
+    PullStats total = {0};
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_lock(&sessions[i].stats_mu);
+        PullStats st = sessions[i].stats;
+        memset(&sessions[i].stats, 0, sizeof(PullStats));
+        pthread_mutex_unlock(&sessions[i].stats_mu);
+
+        total.frames += st.frames;
+        total.decode_us += st.decode_us;
+        total.decode_max_us = FFMAX(total.decode_max_us, st.decode_max_us);
+        total.sws_us += st.sws_us;
+        total.sws_max_us = FFMAX(total.sws_max_us, st.sws_max_us);
+        total.queue_sum += st.queue_sum;
+        total.queue_max = FFMAX(total.queue_max, st.queue_max);
+        total.lag_us += st.lag_us;
+        total.lag_max_us = FFMAX(total.lag_max_us, st.lag_max_us);
+    }
+
+    double frames = total.frames ? (double)total.frames : 1;
+    printf("t=%" PRId64 "s sessions=%d fps=%.1f decode_ms avg=%.2f max=%.2f sws_ms avg=%.2f max=%.2f queue avg=%.1f max=%" PRId64 " lag_ms avg=%.1f max=%.1f\n",
+           elapsed_s, n, total.frames * 1e6 / interval_us, total.decode_us / frames / 1e3, total.decode_max_us / 1e3, total.sws_us / frames / 1e3,
+           total.sws_max_us / 1e3, total.queue_sum / frames, total.queue_max, total.lag_us / frames / 1e3, total.lag_max_us / 1e3);
+    fflush(stdout);
+    return total.frames;
+}
+
+// run_headless decodes n sessions of the stream, each on its own thread,
+// and reports once a second for seconds seconds, or forever if it is 0.
+int run_headless(const char *ip, const char *stream_id, int n, bool convert, int seconds) {
+    MediaPull *sessions = calloc(n, sizeof(MediaPull));
+    for (int i = 0; i < n; i++) {
+        sessions[i].stream_id = stream_id;
+        sessions[i].ip = ip;
+        sessions[i].port = 1935;
+        sessions[i].convert = convert;
+        if (media_pull_init(&sessions[i]) < 0) return -1;
+
+        pthread_t tid;
+        pthread_create(&tid, NULL, headless_thread, &sessions[i]);
+        pthread_detach(tid);
+    }
+
+    int64_t start = av_gettime_relative(), last = start, frames = 0;
+    for (int64_t t = 1; seconds == 0 || t <= seconds; t++) {
+        int64_t wait = start + t * 1000000 - av_gettime_relative();
+        if (wait > 0) av_usleep(wait);
+        int64_t now = av_gettime_relative();
+        frames += report(sessions, n, t, now - last);
+        last = now;
     }
 
-    av_packet_free(&pkt);
+    printf("total: sessions=%d frames=%" PRId64 " fps=%.1f\n", n, frames, frames * 1e6 / (last - start));
     return 0;
 }
 
 int main(int argc, char **argv) {
-    if (argc > 3) {
-        printf("USAGE: %s [domain] [stream_id]\n", argv[0]);
+    bool headless = false, convert = false, yuv = false;
+    int sessions = 1, seconds = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "Hcn:t:y")) != -1) {
+        switch (opt) {
+        case 'H': headless = true; break;
+        case 'c': convert = true; break;
+        case 'n': sessions = atoi(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 'y': yuv = true; break;
+        default: argc = 0; break;
+        }
+    }
+    if (argc == 0 || argc - optind > 2 || sessions < 1) {
+        printf("USAGE: %s [-y | -H [-c] [-n sessions] [-t seconds]] [domain] [stream_id]\n", argv[0]);
+        printf("  -y  convert frames to RGB in a shader instead of with swscale\n");
+        printf("  -H  decode without a window and report decode, conversion and queue statistics\n");
+        printf("  -c  also convert frames to RGBA, as the window does without -y\n");
+        printf("  -n  number of concurrent pull sessions (default 1)\n");
+        printf("  -t  stop after this many seconds (default: run until killed)\n");
         return 0;
     }
 
-    const char *domain = (argc >= 2) ? argv[1] : "livsho.com";
-    const char *stream_id = (argc >= 3) ? argv[2] : "stream";
+    const char *domain = (argc - optind >= 1) ? argv[optind] : "livsho.com";
+    const char *stream_id = (argc - optind >= 2) ? argv[optind + 1] : "stream";
     struct hostent *he = gethostbyname(domain);
     if (!he) {
         printf("Failed to resolve domain: %s\n", domain);
@@ -157,13 +755,20 @@ int main(int argc, char **argv) {
     char ip[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, he->h_addr_list[0], ip, sizeof(ip));
 
+    if (headless) return run_headless(ip, stream_id, sessions, convert, seconds);
+
     MediaPull ctx = {
         .stream_id = stream_id,
         .ip = ip,
         .port = 1935,
     };
 
+    ctx.rgb_frame = av_frame_alloc();
+    ctx.rgb_frame->format = AV_PIX_FMT_RGBA;
+    ctx.rgb_frame->width = W;
+    ctx.rgb_frame->height = H;
     if (media_pull_init(&ctx) < 0) return -1;
+    if (media_pull_start_decoding(&ctx) < 0) return -1;
 
     SetTraceLogLevel(LOG_NONE);
     InitWindow(W, H, "WINDOW");
@@ -171,9 +776,11 @@ int main(int argc, char **argv) {
 
     Image img = {.data = NULL, .width = W, .height = H, .mipmaps = 1, .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
     Texture2D texture = LoadTextureFromImage(img);
+    if (yuv && yuv_renderer_open(&ctx.yuv) < 0) fprintf(stderr, "WARN: cannot build the YUV shader, converting with swscale\n");
+    ctx.yuv_enabled = yuv && ctx.yuv.shader.id != 0;
 
     while (!WindowShouldClose()) {
-        media_pull_decode_render(&ctx, texture, W, H);
+        media_pull_render(&ctx, texture, W, H);
     }
 
     return 0;
@@ -209,6 +816,10 @@ int64_t json_get_int(const char *json, const char *key, int64_t def) {
     return val;
 }
 
+static uint32_t read_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
 ssize_t read_exact(int fd, void *buf, size_t len) {
     size_t total_read = 0;
     uint8_t *ptr = (uint8_t *)buf;
@@ -220,6 +831,28 @@ ssize_t read_exact(int fd, void *buf, size_t len) {
     return total_read;
 }
 
+// recv_exact reads len bytes of the pushed stream into buf. Small reads are
+// served from the receive buffer, which is refilled with as much as the
+// socket has, so one read usually delivers many packets.
+static int recv_exact(MediaPull *ctx, void *buf, size_t len) {
+    uint8_t *dst = (uint8_t *)buf;
+    while (len > 0) {
+        if (ctx->recv_r == ctx->recv_w) {
+            if (len >= RECV_DIRECT_SIZE) return read_exact(ctx->fd, dst, len) < 0 ? -1 : 0;
+            ssize_t n = read(ctx->fd, ctx->recv_buf, RECV_BUFFER_SIZE);
+            if (n <= 0) return -1;
+            ctx->recv_r = 0;
+            ctx->recv_w = n;
+        }
+        size_t k = FFMIN(len, ctx->recv_w - ctx->recv_r);
+        memcpy(dst, ctx->recv_buf + ctx->recv_r, k);
+        ctx->recv_r += k;
+        dst += k;
+        len -= k;
+    }
+    return 0;
+}
+
 void *keep_alive_thread(void *arg) {
     MediaPull *ctx = (MediaPull *)arg;
     while (ctx->keep_alive_running) {
@@ -276,21 +909,25 @@ void *reader_thread(void *arg) {
     ctx->decoder = avcodec_alloc_context3(codec);
     ctx->decoder->time_base = (AVRational){1, fps};
     ctx->decoder->framerate = (AVRational){fps, 1};
-    int ret = avcodec_open2(ctx->decoder, codec, NULL);
+    jitter_clock_set_time_base(&ctx->clock, ctx->decoder->time_base);
+    int ret = open_decoder(ctx->decoder, codec);
     if (ret < 0) {
         fprintf(stderr, "ERROR: cannot open decoder. %s\n", av_err2str(ret));
         exit(0);
     }
 
     ctx->frame = av_frame_alloc();
-    ctx->rgb_frame = av_frame_alloc();
+    if (!ctx->rgb_frame) ctx->rgb_frame = av_frame_alloc();
     ctx->sws_ctx = NULL;
 
     printf("Connected...\n");
 
     while (ctx->reader_running) {
         uint8_t header_buf[28];
-        read_exact(ctx->fd, header_buf, 28);
+        if (recv_exact(ctx, header_buf, 28) < 0) {
+            fprintf(stderr, "Connection closed, stopping reader\n");
+            break;
+        }
 
         int64_t pts = 0, dts = 0;
         int32_t stream_index = 0, flags = 0, size = 0;
@@ -306,20 +943,33 @@ void *reader_thread(void *arg) {
             break;
         }
 
-        uint8_t *data = av_malloc(size);
-        read_exact(ctx->fd, data, size);
-
-        AVPacket *pkt = av_packet_alloc();
-        pkt->data = data;
-        pkt->size = size;
+        AVPacket *pkt = media_pull_get_packet(ctx, size);
+        if (!pkt) {
+            fprintf(stderr, "Cannot allocate a packet of %d bytes, stopping reader\n", size);
+            break;
+        }
+        if (recv_exact(ctx, pkt->data, size) < 0) {
+            fprintf(stderr, "Connection closed, stopping reader\n");
+            media_pull_put_packet(ctx, &pkt);
+            break;
+        }
         pkt->pts = pts;
         pkt->dts = dts;
         pkt->stream_index = stream_index;
-        pkt->flags = flags;
+        pkt->flags = flags & ~FLAG_DISCONTINUITY;
+
+        if (stream_index == 0) {
+            jitter_clock_arrive(&ctx->clock, dts != AV_NOPTS_VALUE ? dts : pts, av_gettime_relative(), flags & FLAG_DISCONTINUITY);
+        }
+
+        if (flags & FLAG_DISCONTINUITY) {
+            printf("Discontinuity: stream=%d dts=%" PRId64 ", publisher restarted\n", stream_index, dts);
+        }
 
         av_thread_message_queue_send(ctx->queue, &pkt, 0);
     }
 
     ctx->reader_running = false;
+    av_thread_message_queue_set_err_recv(ctx->queue, AVERROR_EOF);
     return NULL;
 }
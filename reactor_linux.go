@@ -0,0 +1,569 @@
+//go:build linux
+
+package main
+
+import (
+	"encoding/binary"
+	"fmt"
+	"log/slog"
+	"net"
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+	"unsafe"
+)
+
+const (
+	ReactorReadSize  = 64 << 10
+	ReactorMaxEvents = 256
+)
+
+// Not exported by package syscall.
+const (
+	soReusePort = 0xf
+	efdNonblock = syscall.O_NONBLOCK
+	efdCloexec  = syscall.O_CLOEXEC
+)
+
+// The epoll engine serves every connection from a fixed set of event loops,
+// each with its own SO_REUSEPORT listener, instead of parking a reader and a
+// writer goroutine per viewer. Loops are not locked to OS threads: that turns
+// every handoff between a publisher and a loop into a thread switch. Loops speak the same
+// wire protocol as the goroutine engine and share its push and pull logic;
+// only the socket handling differs.
+type eventLoop struct {
+	server *Server
+	epfd   int
+	lfd    int
+	efd    int
+	conns  map[int]*reactorConn
+	buf    []byte
+
+	// pending holds connections that other goroutines asked to flush or
+	// close; the eventfd wakes the loop when it stops being empty.
+	mu      sync.Mutex
+	pending []*reactorConn
+	spare   []*reactorConn
+}
+
+type connPhase int
+
+const (
+	phaseHandshake connPhase = iota
+	phasePush
+	phaseJoin
+	phasePull
+)
+
+type reactorConn struct {
+	loop   *eventLoop
+	fd     int
+	addr   string
+	phase  connPhase
+	closed bool
+
+	// handshake bytes received so far
+	in []byte
+
+	// push: the publisher's session and the buffer its packets are read into
+	session *PushSession
+	ingest  ingestBuffer
+
+	// join: the result of an openPull that had to wait for an origin
+	joinState *State
+	joinResp  []byte
+	joinErr   error
+
+	// pull: the iovecs left to write, the packets they point into and the
+	// pull response that precedes them
+	client    *Client
+	resp      []byte
+	batch     []*Packet
+	iovs      []syscall.Iovec
+	iovBuf    []syscall.Iovec
+	pollOut   bool
+	scheduled atomic.Bool
+	closing   atomic.Bool
+}
+
+// serveReactor listens on addr with n event loops and serves until one of
+// them fails.
+func (server *Server) serveReactor(addr string, n int) error {
+	tcpAddr, err := net.ResolveTCPAddr("tcp", addr)
+	if err != nil {
+		return err
+	}
+
+	loops := make([]*eventLoop, n)
+	for i := range loops {
+		loops[i], err = newEventLoop(server, tcpAddr)
+		if err != nil {
+			return err
+		}
+	}
+
+	slog.Info("Server listening", "addr", addr, "origin", server.Origin, "engine", "epoll", "loops", n)
+
+	errs := make(chan error, n)
+	for _, loop := range loops {
+		go func(loop *eventLoop) {
+			errs <- loop.run()
+		}(loop)
+	}
+	return <-errs
+}
+
+func newEventLoop(server *Server, addr *net.TCPAddr) (*eventLoop, error) {
+	lfd, err := listenSocket(addr)
+	if err != nil {
+		return nil, err
+	}
+
+	epfd, err := syscall.EpollCreate1(syscall.EPOLL_CLOEXEC)
+	if err != nil {
+		syscall.Close(lfd)
+		return nil, fmt.Errorf("epoll_create1: %w", err)
+	}
+
+	efd, _, errno := syscall.Syscall(syscall.SYS_EVENTFD2, 0, efdNonblock|efdCloexec, 0)
+	if errno != 0 {
+		syscall.Close(lfd)
+		syscall.Close(epfd)
+		return nil, fmt.Errorf("eventfd2: %w", errno)
+	}
+
+	loop := &eventLoop{
+		server: server,
+		epfd:   epfd,
+		lfd:    lfd,
+		efd:    int(efd),
+		conns:  make(map[int]*reactorConn),
+		buf:    make([]byte, ReactorReadSize),
+	}
+
+	for _, fd := range []int{loop.lfd, loop.efd} {
+		event := syscall.EpollEvent{Events: syscall.EPOLLIN, Fd: int32(fd)}
+		if err := syscall.EpollCtl(epfd, syscall.EPOLL_CTL_ADD, fd, &event); err != nil {
+			return nil, fmt.Errorf("epoll_ctl: %w", err)
+		}
+	}
+	return loop, nil
+}
+
+func listenSocket(addr *net.TCPAddr) (int, error) {
+	var sa syscall.Sockaddr
+	domain := syscall.AF_INET
+	if ip4 := addr.IP.To4(); ip4 != nil || addr.IP == nil {
+		sa4 := &syscall.SockaddrInet4{Port: addr.Port}
+		copy(sa4.Addr[:], ip4)
+		sa = sa4
+	} else {
+		sa6 := &syscall.SockaddrInet6{Port: addr.Port}
+		copy(sa6.Addr[:], addr.IP.To16())
+		sa = sa6
+		domain = syscall.AF_INET6
+	}
+
+	fd, err := syscall.Socket(domain, syscall.SOCK_STREAM|syscall.SOCK_NONBLOCK|syscall.SOCK_CLOEXEC, 0)
+	if err != nil {
+		return -1, fmt.Errorf("socket: %w", err)
+	}
+	if err := syscall.SetsockoptInt(fd, syscall.SOL_SOCKET, syscall.SO_REUSEADDR, 1); err != nil {
+		syscall.Close(fd)
+		return -1, fmt.Errorf("SO_REUSEADDR: %w", err)
+	}
+	if err := syscall.SetsockoptInt(fd, syscall.SOL_SOCKET, soReusePort, 1); err != nil {
+		syscall.Close(fd)
+		return -1, fmt.Errorf("SO_REUSEPORT: %w", err)
+	}
+	if err := syscall.Bind(fd, sa); err != nil {
+		syscall.Close(fd)
+		return -1, fmt.Errorf("bind %s: %w", addr, err)
+	}
+	if err := syscall.Listen(fd, syscall.SOMAXCONN); err != nil {
+		syscall.Close(fd)
+		return -1, fmt.Errorf("listen %s: %w", addr, err)
+	}
+	return fd, nil
+}
+
+func (loop *eventLoop) run() error {
+	events := make([]syscall.EpollEvent, ReactorMaxEvents)
+	for {
+		n, err := syscall.EpollWait(loop.epfd, events, -1)
+		if err != nil {
+			if err == syscall.EINTR {
+				continue
+			}
+			return fmt.Errorf("epoll_wait: %w", err)
+		}
+
+		for i := 0; i < n; i++ {
+			fd := int(events[i].Fd)
+			switch fd {
+			case loop.lfd:
+				loop.accept()
+			case loop.efd:
+				loop.wakeup()
+			default:
+				c := loop.conns[fd]
+				if c == nil {
+					continue
+				}
+				if events[i].Events&(syscall.EPOLLIN|syscall.EPOLLRDHUP|syscall.EPOLLHUP|syscall.EPOLLERR) != 0 {
+					c.readable()
+				}
+				if !c.closed && events[i].Events&syscall.EPOLLOUT != 0 {
+					c.flush()
+				}
+			}
+		}
+	}
+}
+
+func (loop *eventLoop) accept() {
+	for {
+		fd, sa, err := syscall.Accept4(loop.lfd, syscall.SOCK_NONBLOCK|syscall.SOCK_CLOEXEC)
+		if err != nil {
+			if err == syscall.EINTR || err == syscall.ECONNABORTED {
+				continue
+			}
+			if err != syscall.EAGAIN {
+				slog.Warn("Cannot accept connection", "err", err)
+			}
+			return
+		}
+
+		syscall.SetsockoptInt(fd, syscall.IPPROTO_TCP, syscall.TCP_NODELAY, 1)
+
+		c := &reactorConn{loop: loop, fd: fd, addr: sockaddrString(sa)}
+		event := syscall.EpollEvent{Events: syscall.EPOLLIN | syscall.EPOLLRDHUP, Fd: int32(fd)}
+		if err := syscall.EpollCtl(loop.epfd, syscall.EPOLL_CTL_ADD, fd, &event); err != nil {
+			slog.Warn("Cannot watch connection", "addr", c.addr, "err", err)
+			syscall.Close(fd)
+			continue
+		}
+		loop.conns[fd] = c
+	}
+}
+
+// wakeup flushes, closes or finishes joining the connections queued by
+// schedule.
+func (loop *eventLoop) wakeup() {
+	var count [8]byte
+	syscall.Read(loop.efd, count[:])
+
+	loop.mu.Lock()
+	pending := loop.pending
+	loop.pending = loop.spare[:0]
+	loop.mu.Unlock()
+
+	for _, c := range pending {
+		c.scheduled.Store(false)
+		switch {
+		case c.closed:
+			if c.joinState != nil {
+				// the viewer left while its edge was joining the stream
+				c.loop.server.Streams.Release(c.joinState)
+				c.joinState = nil
+			}
+		case c.closing.Load():
+			c.close()
+		case c.phase == phaseJoin:
+			c.join()
+		case !c.pollOut:
+			c.flush()
+		}
+	}
+
+	clear(pending)
+	loop.spare = pending
+}
+
+// schedule asks the connection's loop to flush it. It may be called from any
+// goroutine and is cheap when a flush is already pending.
+func (c *reactorConn) schedule() {
+	if !c.scheduled.CompareAndSwap(false, true) {
+		return
+	}
+
+	loop := c.loop
+	loop.mu.Lock()
+	loop.pending = append(loop.pending, c)
+	first := len(loop.pending) == 1
+	loop.mu.Unlock()
+
+	if first {
+		var one [8]byte
+		binary.LittleEndian.PutUint64(one[:], 1)
+		syscall.Write(loop.efd, one[:])
+	}
+}
+
+// requestClose closes the connection on its loop; it backs Client.Close.
+func (c *reactorConn) requestClose() {
+	c.closing.Store(true)
+	c.schedule()
+}
+
+func (c *reactorConn) readable() {
+	for {
+		// a publisher reads straight into its ingest buffer, everybody else
+		// into the loop's
+		buf := c.loop.buf
+		if c.phase == phasePush {
+			buf = c.ingest.space()
+		}
+		n, err := syscall.Read(c.fd, buf)
+		if err == syscall.EINTR {
+			continue
+		}
+		if err == syscall.EAGAIN {
+			return
+		}
+		if n <= 0 || err != nil {
+			c.close()
+			return
+		}
+		if c.phase == phasePush {
+			c.session.State.IngestReads.Add(1)
+			err = c.ingest.commit(n, c.session)
+			if err == nil && c.session.Superseded() {
+				c.close()
+				return
+			}
+		} else {
+			err = c.consume(buf[:n])
+		}
+		if err != nil {
+			slog.Warn("Closing connection", "addr", c.addr, "err", err)
+			c.close()
+		}
+		return
+	}
+}
+
+// consume parses bytes read from the connection according to its phase.
+func (c *reactorConn) consume(data []byte) error {
+	for len(data) > 0 {
+		switch c.phase {
+		case phaseHandshake:
+			rest, err := c.handshake(data)
+			if err != nil {
+				return err
+			}
+			data = rest
+
+		case phasePush:
+			return c.ingest.write(data, c.session)
+
+		case phaseJoin, phasePull:
+			// keepalive bytes
+			return nil
+		}
+	}
+	return nil
+}
+
+// handshake accumulates the framed handshake and, once complete,
+// switches the connection to push or pull. It returns the bytes that follow
+// the handshake.
+func (c *reactorConn) handshake(data []byte) ([]byte, error) {
+	c.in = append(c.in, data...)
+	n, length, binaryFrame, err := handshakeFrame(c.in)
+	if n == 0 || err != nil {
+		return nil, err
+	}
+	if len(c.in) < n+int(length) {
+		return nil, nil
+	}
+
+	handshake, err := parseHandshake(c.in[n:n+int(length)], binaryFrame)
+	if err != nil {
+		return nil, err
+	}
+	rest := c.in[n+int(length):]
+	c.in = nil
+
+	server := c.loop.server
+	switch handshake.Mode {
+	case "push":
+		session, err := server.openPush(handshake, true, c.requestClose)
+		if err != nil {
+			return nil, err
+		}
+		c.session = session
+		c.phase = phasePush
+
+	case "pull":
+		if server.Origin != "" {
+			// an edge may have to wait for the origin, which must not
+			// stall the loop
+			c.phase = phaseJoin
+			go func() {
+				c.joinState, c.joinResp, c.joinErr = server.openPull(handshake)
+				c.schedule()
+			}()
+			return rest, nil
+		}
+
+		state, resp, err := server.openPull(handshake)
+		if err != nil {
+			return nil, err
+		}
+		c.startPull(state, resp)
+
+	default:
+		return nil, fmt.Errorf("mode %s is not supported", handshake.Mode)
+	}
+	return rest, nil
+}
+
+// join finishes a pull handshake started in phaseJoin.
+func (c *reactorConn) join() {
+	if c.joinErr != nil {
+		slog.Warn("Invalid pull request", "err", c.joinErr)
+		c.close()
+		return
+	}
+	c.startPull(c.joinState, c.joinResp)
+	c.joinState, c.joinResp = nil, nil
+}
+
+func (c *reactorConn) startPull(state *State, resp []byte) {
+	c.phase = phasePull
+	c.resp = resp
+	c.iovBuf = make([]syscall.Iovec, 0, 2*WriterBatch)
+	c.batch = make([]*Packet, 0, WriterBatch)
+	c.iovs = append(c.iovBuf[:0], iovec(resp))
+
+	c.client = NewClient(nil, state.ID)
+	c.client.Addr = c.addr
+	c.client.wake = c.schedule
+	c.client.onClose = c.requestClose
+	c.loop.server.addClient(c.client, state)
+	c.flush()
+}
+
+// flush writes queued packets with non-blocking writev calls until the
+// queue is empty or the socket is full, in which case it waits for EPOLLOUT.
+func (c *reactorConn) flush() {
+	for !c.closed {
+		if len(c.iovs) == 0 {
+			c.client.sent(c.batch)
+			c.releaseBatch()
+			c.batch = c.client.collect(c.batch)
+			if len(c.batch) == 0 {
+				c.watchWrite(false)
+				return
+			}
+			c.iovs = c.iovBuf[:0]
+			for _, pkt := range c.batch {
+				c.iovs = append(c.iovs, iovec(pkt.Head[:]))
+				if len(pkt.Payload) > 0 {
+					c.iovs = append(c.iovs, iovec(pkt.Payload))
+				}
+			}
+		}
+
+		start := time.Now()
+		n, err := writev(c.fd, c.iovs)
+		c.client.WriteLatency.Observe(time.Since(start))
+		switch err {
+		case nil:
+			c.advance(n)
+		case syscall.EINTR:
+		case syscall.EAGAIN:
+			c.watchWrite(true)
+			return
+		default:
+			slog.Info("Failed to send packet to client", "stream_id", c.client.StreamID, "err", err)
+			c.close()
+			return
+		}
+	}
+}
+
+// advance drops the first n written bytes from the pending iovecs.
+func (c *reactorConn) advance(n int) {
+	for len(c.iovs) > 0 {
+		iov := &c.iovs[0]
+		if uint64(n) < iov.Len {
+			iov.Base = (*byte)(unsafe.Add(unsafe.Pointer(iov.Base), n))
+			iov.Len -= uint64(n)
+			return
+		}
+		n -= int(iov.Len)
+		c.iovs = c.iovs[1:]
+	}
+}
+
+func (c *reactorConn) releaseBatch() {
+	for _, pkt := range c.batch {
+		pkt.Release()
+	}
+	clear(c.batch)
+	c.batch = c.batch[:0]
+	c.resp = nil
+}
+
+func (c *reactorConn) watchWrite(on bool) {
+	if c.pollOut == on {
+		return
+	}
+	c.pollOut = on
+
+	events := uint32(syscall.EPOLLIN | syscall.EPOLLRDHUP)
+	if on {
+		events |= syscall.EPOLLOUT
+	}
+	event := syscall.EpollEvent{Events: events, Fd: int32(c.fd)}
+	syscall.EpollCtl(c.loop.epfd, syscall.EPOLL_CTL_MOD, c.fd, &event)
+}
+
+func (c *reactorConn) close() {
+	if c.closed {
+		return
+	}
+	c.closed = true
+
+	syscall.EpollCtl(c.loop.epfd, syscall.EPOLL_CTL_DEL, c.fd, nil)
+	delete(c.loop.conns, c.fd)
+	syscall.Close(c.fd)
+
+	c.ingest.Close()
+	if c.session != nil {
+		c.session.Close()
+	}
+	if c.client != nil {
+		c.releaseBatch()
+		c.iovs = nil
+		c.loop.server.removeClient(c.client)
+	}
+}
+
+func iovec(b []byte) syscall.Iovec {
+	iov := syscall.Iovec{Base: unsafe.SliceData(b)}
+	iov.SetLen(len(b))
+	return iov
+}
+
+func writev(fd int, iovs []syscall.Iovec) (int, error) {
+	n, _, errno := syscall.Syscall(syscall.SYS_WRITEV, uintptr(fd), uintptr(unsafe.Pointer(&iovs[0])), uintptr(len(iovs)))
+	if errno != 0 {
+		return 0, errno
+	}
+	return int(n), nil
+}
+
+func sockaddrString(sa syscall.Sockaddr) string {
+	switch sa := sa.(type) {
+	case *syscall.SockaddrInet4:
+		return net.JoinHostPort(net.IP(sa.Addr[:]).String(), strconv.Itoa(sa.Port))
+	case *syscall.SockaddrInet6:
+		return net.JoinHostPort(net.IP(sa.Addr[:]).String(), strconv.Itoa(sa.Port))
+	}
+	return "unknown"
+}
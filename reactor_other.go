@@ -0,0 +1,9 @@
+//go:build !linux
+
+package main
+
+import "errors"
+
+func (server *Server) serveReactor(addr string, n int) error {
+	return errors.New("the epoll engine is only available on Linux")
+}
@@ -0,0 +1,249 @@
+package main
+
+import (
+	"bufio"
+	"encoding/binary"
+	"log/slog"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"sync/atomic"
+	"time"
+	"unsafe"
+)
+
+const (
+	RecordBufferSize    = 4 << 20
+	RecordQueueLen      = 4096
+	RecordFlushInterval = time.Second
+	RecordExtension     = ".sfu"
+	RecordIndexExt      = ".idx"
+	DirectIOAlignment   = 4096
+)
+
+// Recorder writes a stream to disk on its own goroutine so that a slow disk
+// never back-pressures ingest: packets it cannot keep up with are dropped
+// from the recording and counted instead. Creating, flushing and closing the
+// files all happen on that goroutine too, so neither NewRecorder nor Close
+// blocks the connection engine that calls them.
+//
+// The recording is the push wire format: the framed handshake, in the
+// encoding the publisher used, followed by every packet (video and audio) as a
+// 28-byte header plus payload, so it can be pushed back to a relay as is. A
+// companion index holds one little-endian (pts, offset) pair of int64s per
+// video keyframe.
+type Recorder struct {
+	StreamID string
+	Path     string
+
+	handshake []byte
+	prealloc  int64
+
+	file   *os.File
+	index  *bufio.Writer
+	ifile  *os.File
+	direct bool
+	failed bool
+
+	queue chan recordedPacket
+
+	buf    []byte
+	n      int
+	offset int64
+
+	WrittenBytes   atomic.Int64
+	DroppedBytes   atomic.Int64
+	DroppedPackets atomic.Int64
+}
+
+// NewRecorder starts the writer goroutine of the recording of publisher
+// session gen of streamID in dir, which creates the file and starts it with
+// the framed handshake. The first session is recorded to <stream_id>.sfu,
+// later ones to <stream_id>.<gen>.sfu. With direct set the file is written
+// with O_DIRECT where the platform supports it; prealloc reserves that many
+// bytes up front. A recording that cannot be created is logged and its
+// packets are counted as dropped.
+func NewRecorder(dir, streamID string, gen uint32, handshake []byte, direct bool, prealloc int64) *Recorder {
+	name := filepath.Base(streamID)
+	if gen > 1 {
+		name += "." + strconv.FormatUint(uint64(gen), 10)
+	}
+	r := &Recorder{
+		StreamID:  streamID,
+		Path:      filepath.Join(dir, name+RecordExtension),
+		handshake: handshake,
+		prealloc:  prealloc,
+		direct:    direct,
+		queue:     make(chan recordedPacket, RecordQueueLen),
+	}
+
+	go r.run()
+	return r
+}
+
+// open creates the recording and its index and writes the handshake.
+func (r *Recorder) open() error {
+	file, err := openRecording(r.Path, r.direct)
+	if err != nil {
+		return err
+	}
+
+	if r.prealloc > 0 {
+		if err := preallocate(file, r.prealloc); err != nil {
+			slog.Warn("Cannot preallocate recording", "path", r.Path, "bytes", r.prealloc, "err", err)
+		}
+	}
+
+	ifile, err := os.Create(strings.TrimSuffix(r.Path, RecordExtension) + RecordIndexExt)
+	if err != nil {
+		file.Close()
+		return err
+	}
+
+	r.file = file
+	r.ifile = ifile
+	r.index = bufio.NewWriter(ifile)
+	r.buf = alignedBuffer(RecordBufferSize)
+	r.append(r.handshake)
+	return nil
+}
+
+// recordedPacket is a queued packet and its header as it was when it was
+// queued: the publisher goroutine rewrites a packet's header in place when it
+// normalises its timestamps, and the recording keeps the publisher's own.
+type recordedPacket struct {
+	head [HeaderSize]byte
+	pkt  *Packet
+}
+
+// Write queues pkt for recording without blocking. It takes its own
+// reference, so the caller keeps ownership of pkt. It must be called before
+// pkt is handed to the publisher goroutine.
+func (r *Recorder) Write(pkt *Packet) {
+	pkt.Retain()
+	select {
+	case r.queue <- recordedPacket{head: pkt.Head, pkt: pkt}:
+	default:
+		pkt.Release()
+		r.DroppedPackets.Add(1)
+		r.DroppedBytes.Add(int64(HeaderSize + len(pkt.Payload)))
+	}
+}
+
+// Close asks the writer goroutine to flush what is queued and close the
+// files, without waiting for it. Write must not be called afterwards.
+func (r *Recorder) Close() {
+	close(r.queue)
+}
+
+func (r *Recorder) run() {
+	if err := r.open(); err != nil {
+		slog.Error("Cannot create recording", "stream_id", r.StreamID, "path", r.Path, "err", err)
+		r.failed = true
+	}
+
+	ticker := time.NewTicker(RecordFlushInterval)
+	defer ticker.Stop()
+
+	for {
+		select {
+		case rec, ok := <-r.queue:
+			if !ok {
+				r.finish()
+				return
+			}
+			h := DecodeHeader(rec.head[:])
+			if h.StreamIndex == 0 && h.Flags&1 != 0 && r.index != nil {
+				var entry [16]byte
+				binary.LittleEndian.PutUint64(entry[0:8], uint64(h.Pts))
+				binary.LittleEndian.PutUint64(entry[8:16], uint64(r.offset))
+				r.index.Write(entry[:])
+			}
+			r.append(rec.head[:])
+			r.append(rec.pkt.Payload)
+			rec.pkt.Release()
+		case <-ticker.C:
+			r.flush()
+			if r.index != nil {
+				r.index.Flush()
+			}
+		}
+	}
+}
+
+// append copies data into the write buffer, flushing every time it fills up.
+func (r *Recorder) append(data []byte) {
+	if r.failed {
+		r.DroppedBytes.Add(int64(len(data)))
+		return
+	}
+	r.offset += int64(len(data))
+	for len(data) > 0 {
+		c := copy(r.buf[r.n:], data)
+		r.n += c
+		data = data[c:]
+		if r.n == len(r.buf) {
+			r.flush()
+		}
+	}
+}
+
+// flush writes the buffered data. Under O_DIRECT only whole aligned blocks can
+// be written, so the unaligned tail stays buffered for the next flush.
+func (r *Recorder) flush() {
+	size := r.n
+	if r.direct {
+		size &^= DirectIOAlignment - 1
+	}
+	if size == 0 || r.failed {
+		return
+	}
+
+	written, err := r.file.Write(r.buf[:size])
+	r.WrittenBytes.Add(int64(written))
+	if err != nil {
+		slog.Error("Cannot write recording", "path", r.Path, "err", err)
+		r.DroppedBytes.Add(int64(r.n - written))
+		r.failed = true
+		r.n = 0
+		return
+	}
+
+	r.n = copy(r.buf, r.buf[size:r.n])
+}
+
+func (r *Recorder) finish() {
+	defer func() {
+		slog.Info("Recording closed", "stream_id", r.StreamID, "path", r.Path, "written_bytes", r.WrittenBytes.Load(),
+			"dropped_bytes", r.DroppedBytes.Load(), "dropped_packets", r.DroppedPackets.Load())
+	}()
+	if r.file == nil {
+		return
+	}
+
+	if r.direct && r.n > 0 {
+		if err := disableDirectIO(r.file); err != nil {
+			slog.Error("Cannot leave direct I/O", "path", r.Path, "err", err)
+		}
+		r.direct = false
+	}
+	r.flush()
+	if !r.failed {
+		r.file.Truncate(r.offset)
+	}
+	r.file.Close()
+
+	r.index.Flush()
+	r.ifile.Close()
+}
+
+// alignedBuffer returns a buffer whose start is aligned for direct I/O.
+func alignedBuffer(size int) []byte {
+	b := make([]byte, size+DirectIOAlignment)
+	off := int(uintptr(unsafe.Pointer(&b[0])) & (DirectIOAlignment - 1))
+	if off != 0 {
+		off = DirectIOAlignment - off
+	}
+	return b[off : off+size : off+size]
+}
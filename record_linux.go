@@ -0,0 +1,36 @@
+//go:build linux
+
+package main
+
+import (
+	"os"
+	"syscall"
+)
+
+const fallocKeepSize = 0x1
+
+func openRecording(path string, direct bool) (*os.File, error) {
+	flags := os.O_CREATE | os.O_WRONLY | os.O_TRUNC
+	if direct {
+		flags |= syscall.O_DIRECT
+	}
+	return os.OpenFile(path, flags, 0o644)
+}
+
+// preallocate reserves blocks without changing the file size, so the file
+// still reads back as exactly what was written.
+func preallocate(file *os.File, size int64) error {
+	return syscall.Fallocate(int(file.Fd()), fallocKeepSize, 0, size)
+}
+
+func disableDirectIO(file *os.File) error {
+	fd := file.Fd()
+	flags, _, errno := syscall.Syscall(syscall.SYS_FCNTL, fd, syscall.F_GETFL, 0)
+	if errno != 0 {
+		return errno
+	}
+	if _, _, errno := syscall.Syscall(syscall.SYS_FCNTL, fd, syscall.F_SETFL, flags&^syscall.O_DIRECT); errno != 0 {
+		return errno
+	}
+	return nil
+}
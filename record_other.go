@@ -0,0 +1,23 @@
+//go:build !linux
+
+package main
+
+import (
+	"errors"
+	"os"
+)
+
+func openRecording(path string, direct bool) (*os.File, error) {
+	if direct {
+		return nil, errors.New("direct I/O is not supported on this platform")
+	}
+	return os.Create(path)
+}
+
+func preallocate(file *os.File, size int64) error {
+	return nil
+}
+
+func disableDirectIO(file *os.File) error {
+	return nil
+}
@@ -0,0 +1,194 @@
+package main
+
+import (
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// StreamShards must be a power of two.
+const StreamShards = 64
+
+// Registry maps stream IDs to their State. It is split into shards by a hash
+// of the stream ID so that joins, leaves and publisher connects on unrelated
+// streams do not serialise on one lock. Every shard keeps its own lock
+// statistics so that contention can be measured without a shared counter
+// becoming the next bottleneck.
+type Registry struct {
+	shards [StreamShards]streamShard
+}
+
+type streamShard struct {
+	mu      sync.RWMutex
+	streams map[string]*State
+	stats   LockStats
+
+	// keep neighbouring shards' locks off this cache line
+	_ [64]byte
+}
+
+// LockStats describes how a lock has been used: how often it was taken, how
+// often the taker had to wait for it and for how long, and how long exclusive
+// holders kept it.
+type LockStats struct {
+	Acquired     atomic.Int64
+	Contended    atomic.Int64
+	WaitNanos    atomic.Int64
+	HoldNanos    atomic.Int64
+	MaxHoldNanos atomic.Int64
+}
+
+// LockSnapshot is a plain copy of LockStats.
+type LockSnapshot struct {
+	Acquired     int64
+	Contended    int64
+	WaitNanos    int64
+	HoldNanos    int64
+	MaxHoldNanos int64
+}
+
+func NewRegistry() *Registry {
+	r := &Registry{}
+	for i := range r.shards {
+		r.shards[i].streams = make(map[string]*State)
+	}
+	return r
+}
+
+func (r *Registry) shard(id string) *streamShard {
+	return &r.shards[hashStreamID(id)&(StreamShards-1)]
+}
+
+// hashStreamID hashes id with FNV-1a.
+func hashStreamID(id string) uint32 {
+	h := uint32(2166136261)
+	for i := 0; i < len(id); i++ {
+		h ^= uint32(id[i])
+		h *= 16777619
+	}
+	return h
+}
+
+// Acquire returns the state of stream id with a reference that the caller
+// must give back with Release, or nil if there is no such stream.
+func (r *Registry) Acquire(id string) *State {
+	shard := r.shard(id)
+	shard.rlock()
+	state := shard.streams[id]
+	if state != nil {
+		state.users.Add(1)
+	}
+	shard.mu.RUnlock()
+	return state
+}
+
+// AcquireOrCreate is Acquire, creating the stream with create if it does not
+// exist yet. created is true only for the caller that created it.
+func (r *Registry) AcquireOrCreate(id string, create func(string) *State) (state *State, created bool) {
+	if state := r.Acquire(id); state != nil {
+		return state, false
+	}
+
+	shard := r.shard(id)
+	acquired := shard.lock()
+	defer shard.unlock(acquired)
+
+	if state, ok := shard.streams[id]; ok {
+		state.users.Add(1)
+		return state, false
+	}
+	state = create(id)
+	state.users.Store(1)
+	shard.streams[id] = state
+	return state, true
+}
+
+// Release gives back a reference taken by Acquire or AcquireOrCreate. A
+// stream nobody holds a reference to is left to Reap.
+func (r *Registry) Release(state *State) {
+	state.idleSince.Store(time.Now().UnixNano())
+	if state.users.Add(-1) < 0 {
+		panic("sfu: stream released more times than acquired")
+	}
+}
+
+// Reap removes the streams that have had no references for at least idle
+// and returns them. References are only taken under a shard lock, so a stream
+// that is unreferenced while its shard is write-locked stays that way once it
+// is out of the map.
+func (r *Registry) Reap(idle time.Duration) []*State {
+	var reaped []*State
+	deadline := time.Now().Add(-idle).UnixNano()
+	for i := range r.shards {
+		shard := &r.shards[i]
+		acquired := shard.lock()
+		for id, state := range shard.streams {
+			if state.users.Load() == 0 && state.idleSince.Load() <= deadline {
+				delete(shard.streams, id)
+				reaped = append(reaped, state)
+			}
+		}
+		shard.unlock(acquired)
+	}
+	return reaped
+}
+
+// Range calls f for every stream, holding one shard's read lock at a time.
+func (r *Registry) Range(f func(*State)) {
+	for i := range r.shards {
+		shard := &r.shards[i]
+		shard.rlock()
+		for _, state := range shard.streams {
+			f(state)
+		}
+		shard.mu.RUnlock()
+	}
+}
+
+// LockStats sums the lock statistics of all shards.
+func (r *Registry) LockStats() LockSnapshot {
+	var s LockSnapshot
+	for i := range r.shards {
+		stats := &r.shards[i].stats
+		s.Acquired += stats.Acquired.Load()
+		s.Contended += stats.Contended.Load()
+		s.WaitNanos += stats.WaitNanos.Load()
+		s.HoldNanos += stats.HoldNanos.Load()
+		s.MaxHoldNanos = max(s.MaxHoldNanos, stats.MaxHoldNanos.Load())
+	}
+	return s
+}
+
+func (shard *streamShard) rlock() {
+	if !shard.mu.TryRLock() {
+		start := time.Now()
+		shard.mu.RLock()
+		shard.stats.Contended.Add(1)
+		shard.stats.WaitNanos.Add(int64(time.Since(start)))
+	}
+	shard.stats.Acquired.Add(1)
+}
+
+func (shard *streamShard) lock() time.Time {
+	if !shard.mu.TryLock() {
+		start := time.Now()
+		shard.mu.Lock()
+		shard.stats.Contended.Add(1)
+		shard.stats.WaitNanos.Add(int64(time.Since(start)))
+	}
+	shard.stats.Acquired.Add(1)
+	return time.Now()
+}
+
+func (shard *streamShard) unlock(acquired time.Time) {
+	hold := int64(time.Since(acquired))
+	shard.mu.Unlock()
+
+	shard.stats.HoldNanos.Add(hold)
+	for {
+		prev := shard.stats.MaxHoldNanos.Load()
+		if hold <= prev || shard.stats.MaxHoldNanos.CompareAndSwap(prev, hold) {
+			return
+		}
+	}
+}
@@ -0,0 +1,122 @@
+package main
+
+import (
+	"bytes"
+	"fmt"
+	"log/slog"
+)
+
+// ParamSetStreamIndex marks a parameter-set packet. Its payload is a binary
+// pull response (see handshake.go) carrying the stream's new codec
+// parameters, sent in band when a publisher takes a stream over so that
+// viewers can reconfigure their decoders without reconnecting.
+const ParamSetStreamIndex = -1
+
+// setCodec publishes the codec parameters of h and drops the cached GOP,
+// which was encoded with the old ones. It must be called with Mu held.
+func (state *State) setCodec(h *Handshake) {
+	state.VideoCodecID = h.VideoCodecID
+	state.AudioCodecID = h.AudioCodecID
+	state.FPS = h.FPS
+	state.Width = h.Width
+	state.Height = h.Height
+	state.VideoExtra = h.VideoExtra
+	state.AudioExtra = h.AudioExtra
+	state.responses = [2][]byte{}
+	state.resetCache()
+}
+
+// codec returns the stream's codec parameters as a pull response. It must be
+// called with Mu held.
+func (state *State) codec(binaryFrame bool) *Handshake {
+	return &Handshake{
+		StreamID:     state.ID,
+		VideoCodecID: state.VideoCodecID,
+		AudioCodecID: state.AudioCodecID,
+		FPS:          state.FPS,
+		Width:        state.Width,
+		Height:       state.Height,
+		VideoExtra:   state.VideoExtra,
+		AudioExtra:   state.AudioExtra,
+		Binary:       binaryFrame,
+	}
+}
+
+// takeOver switches the stream to a staged session once it has a keyframe to
+// start from: the session's codec parameters replace the stream's, the
+// connection of the publisher it replaces is closed, and the session's next
+// packet is preceded by a parameter-set packet. The old connection is closed
+// rather than left to notice on its next read, which a half-dead connection
+// may never return from.
+func (session *PushSession) takeOver() {
+	state := session.State
+	state.Mu.Lock()
+	old := state.active
+	state.setCodec(session.handshake)
+	state.active = session
+	state.Mu.Unlock()
+
+	if old != nil {
+		old.superseded.Store(true)
+		old.stop()
+	}
+	session.staged = false
+	session.announce = true
+	session.startRecording()
+	slog.Info("Push client took over", "stream_id", session.StreamID, "superseded", old != nil)
+}
+
+// startRecording opens the session's recording, if it is recorded. Every
+// publisher session of a stream gets a file of its own, so a session taking
+// over never truncates the recording its predecessor may still be writing.
+func (session *PushSession) startRecording() {
+	if session.recordHandshake == nil {
+		return
+	}
+	server := session.server
+	session.record = NewRecorder(server.RecordDir, session.StreamID, session.gen, session.recordHandshake,
+		server.RecordDirect, server.RecordPrealloc)
+}
+
+// paramSet returns a parameter-set packet for the stream's current codec
+// parameters.
+func (state *State) paramSet() *Packet {
+	state.Mu.RLock()
+	payload := state.codec(true).encodeBinary()
+	state.Mu.RUnlock()
+
+	pkt := NewPacket(Header{
+		Pts:         NoTimestamp,
+		Dts:         NoTimestamp,
+		StreamIndex: ParamSetStreamIndex,
+		Size:        int32(len(payload)),
+	})
+	copy(pkt.Payload, payload)
+	return pkt
+}
+
+// applyParamSet publishes the codec parameters of a parameter-set packet
+// received from upstream, as an edge does when its origin's publisher
+// changes.
+func (state *State) applyParamSet(payload []byte) error {
+	// the decoded extradata points into the payload, which goes back to a
+	// pool once the packet has been sent
+	payload = bytes.Clone(payload)
+	n, length, binaryFrame, err := handshakeFrame(payload)
+	if err != nil {
+		return err
+	}
+	if n == 0 || !binaryFrame || n+int(length) > len(payload) {
+		return fmt.Errorf("truncated parameter set")
+	}
+	h, err := parseHandshake(payload[n:n+int(length)], true)
+	if err != nil {
+		return err
+	}
+
+	state.Mu.Lock()
+	h.StreamID = state.ID
+	state.setCodec(h)
+	state.Mu.Unlock()
+	return nil
+}
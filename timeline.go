@@ -0,0 +1,101 @@
+package main
+
+import "math"
+
+const (
+	// FlagDiscontinuity is set in the flags of the first packet of each
+	// elementary stream after the relay rebased its timestamps. It sits
+	// above the AV_PKT_FLAG_* bits publishers copy from FFmpeg, and an edge
+	// passes on the one its origin set.
+	FlagDiscontinuity = 1 << 16
+
+	// NoTimestamp is FFmpeg's AV_NOPTS_VALUE; such timestamps are passed on
+	// untouched.
+	NoTimestamp = math.MinInt64
+
+	// MaxTimelineTracks bounds the stream indices whose timestamps are
+	// normalised; packets of higher indices pass through unchanged.
+	MaxTimelineTracks = 8
+
+	// TimelineResetSteps is how many packet durations DTS has to go back
+	// within one publisher session to be taken for a clock reset rather
+	// than jitter to clamp.
+	TimelineResetSteps = 10
+)
+
+// timeline keeps the timestamps a stream's viewers see continuous and
+// monotonic across publisher reconnects. Every elementary stream is handled
+// on its own, in its own time base, which the relay does not know: when a new
+// publisher session starts, or a publisher's DTS jumps far back, the stream's
+// timestamps are offset so that its next packet lands one packet duration
+// after the last one the viewers got. It is only used by the stream's
+// publisher goroutine.
+type timeline struct {
+	tracks []track
+}
+
+type track struct {
+	started bool
+	// rebase asks for a new offset at the track's next packet
+	rebase bool
+	offset int64
+
+	// lastIn is the last DTS received, lastOut the last one sent and step
+	// the last increase between two sent packets
+	lastIn  int64
+	lastOut int64
+	step    int64
+}
+
+// normalize rewrites pkt's timestamps in place. It must be called before pkt
+// is shared with the cache or any viewer.
+func (t *timeline) normalize(pkt *Packet) {
+	if pkt.restart {
+		for i := range t.tracks {
+			t.tracks[i].rebase = true
+		}
+	}
+
+	h := &pkt.Header
+	index := int(h.StreamIndex)
+	if index < 0 || index >= MaxTimelineTracks || h.Dts == NoTimestamp {
+		return
+	}
+	if index >= len(t.tracks) {
+		t.tracks = append(t.tracks, make([]track, index+1-len(t.tracks))...)
+	}
+	tr := &t.tracks[index]
+
+	flags := h.Flags
+	step := max(tr.step, 1)
+	if tr.started && !tr.rebase && h.Dts < tr.lastIn-TimelineResetSteps*step {
+		tr.rebase = true
+	}
+	if tr.started && tr.rebase {
+		tr.offset = tr.lastOut + step - h.Dts
+		flags |= FlagDiscontinuity
+	}
+	tr.rebase = false
+	tr.lastIn = h.Dts
+
+	dts := h.Dts + tr.offset
+	clamped := tr.started && dts <= tr.lastOut
+	if clamped {
+		dts = tr.lastOut + 1
+	}
+	pts := h.Pts
+	if pts != NoTimestamp {
+		pts = max(pts+tr.offset, dts)
+	}
+
+	if tr.started && !clamped {
+		tr.step = dts - tr.lastOut
+	}
+	tr.lastOut = dts
+	tr.started = true
+
+	if dts != h.Dts || pts != h.Pts || flags != h.Flags {
+		h.Dts, h.Pts, h.Flags = dts, pts, flags
+		h.Encode(pkt.Head[:])
+	}
+}
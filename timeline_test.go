@@ -0,0 +1,139 @@
+package main
+
+import (
+	"fmt"
+	"testing"
+)
+
+// timelineStep is one packet through normalize: what the publisher sent and
+// what the viewers should get.
+type timelineStep struct {
+	index    int32
+	pts, dts int64
+	flags    int32
+	restart  bool
+
+	wantPts, wantDts int64
+	wantFlags        int32
+}
+
+// same is a packet normalize passes on unchanged.
+func same(index int32, pts, dts int64, flags int32) timelineStep {
+	return timelineStep{index: index, pts: pts, dts: dts, flags: flags, wantPts: pts, wantDts: dts, wantFlags: flags}
+}
+
+// video is a video packet with PTS one tick after DTS, rewritten to wantDts.
+func video(dts, wantDts int64, flags int32) timelineStep {
+	return timelineStep{pts: dts + 1, dts: dts, flags: flags, wantPts: wantDts + 1, wantDts: wantDts, wantFlags: flags}
+}
+
+func restarted(s timelineStep) timelineStep {
+	s.restart = true
+	return s
+}
+
+func TestTimelineNormalize(t *testing.T) {
+	const key = 1
+	const disc = FlagDiscontinuity
+	for _, tc := range []struct {
+		name  string
+		steps []timelineStep
+	}{
+		{"first session passes through", []timelineStep{
+			restarted(video(1000, 1000, key)), video(1001, 1001, 0), video(1002, 1002, 0),
+		}},
+		{"restart continues after the last packet", []timelineStep{
+			restarted(video(100, 100, key)), video(101, 101, 0), video(102, 102, 0),
+			restarted(video(0, 103, key|disc)), video(1, 104, 0), video(2, 105, 0),
+		}},
+		{"restart after a forward jump", []timelineStep{
+			video(0, 0, key), video(1, 1, 0), video(2, 2, 0),
+			restarted(video(90000, 3, key|disc)), video(90001, 4, 0),
+		}},
+		{"offset carries over restarts", []timelineStep{
+			video(10, 10, key), video(11, 11, 0),
+			restarted(video(0, 12, key|disc)), video(1, 13, 0),
+			restarted(video(500, 14, key|disc)), video(501, 15, 0),
+		}},
+		{"rebase uses the last step", []timelineStep{
+			video(0, 0, key), video(3000, 3000, 0), video(6000, 6000, 0),
+			restarted(video(0, 9000, key|disc)), video(3000, 12000, 0),
+		}},
+		{"clock reset within a session rebases", []timelineStep{
+			video(100, 100, key), video(101, 101, 0), video(102, 102, 0),
+			video(50, 103, disc), video(51, 104, 0),
+		}},
+		{"small step back is clamped", []timelineStep{
+			video(100, 100, key), video(102, 102, 0), video(104, 104, 0),
+			{pts: 102, dts: 101, wantPts: 105, wantDts: 105},
+			video(106, 106, 0), video(107, 107, 0),
+		}},
+		{"a clamped packet keeps the step", []timelineStep{
+			video(100, 100, key), video(102, 102, 0), video(104, 104, 0),
+			{pts: 102, dts: 101, wantPts: 105, wantDts: 105},
+			restarted(video(0, 107, key|disc)),
+		}},
+		{"repeated DTS is clamped", []timelineStep{
+			video(100, 100, key),
+			{pts: 101, dts: 100, wantPts: 101, wantDts: 101},
+			{pts: 101, dts: 100, wantPts: 102, wantDts: 102},
+			video(103, 103, 0),
+		}},
+		{"step back of exactly ten steps is clamped", []timelineStep{
+			video(100, 100, key), video(101, 101, 0),
+			{pts: 92, dts: 91, wantPts: 102, wantDts: 102},
+		}},
+		{"PTS is kept at or after DTS", []timelineStep{
+			video(100, 100, key), video(101, 101, 0),
+			restarted(timelineStep{pts: 0, dts: 5, flags: key, wantPts: 102, wantDts: 102, wantFlags: key | disc}),
+		}},
+		{"NoTimestamp DTS passes through and is not tracked", []timelineStep{
+			video(100, 100, key), same(0, 7, NoTimestamp, 0), same(0, NoTimestamp, NoTimestamp, 0), video(101, 101, 0),
+		}},
+		{"NoTimestamp PTS stays unset", []timelineStep{
+			video(0, 0, key), video(1, 1, 0),
+			restarted(timelineStep{pts: NoTimestamp, dts: 0, flags: key, wantPts: NoTimestamp, wantDts: 2, wantFlags: key | disc}),
+		}},
+		{"a restart rebases every track at its next packet", []timelineStep{
+			video(0, 0, key), same(1, 0, 0, key), video(1, 1, 0), same(1, 1024, 1024, key),
+			restarted(video(0, 2, key|disc)), video(1, 3, 0),
+			{index: 1, pts: 0, dts: 0, flags: key, wantPts: 2048, wantDts: 2048, wantFlags: key | disc},
+			{index: 1, pts: 1024, dts: 1024, flags: key, wantPts: 3072, wantDts: 3072, wantFlags: key},
+		}},
+		{"tracks rebase independently", []timelineStep{
+			video(0, 0, key), same(1, 0, 0, key), video(1, 1, 0), same(1, 1024, 1024, key),
+			video(-1000, 2, disc), same(1, 2048, 2048, key),
+		}},
+		{"untracked stream indices pass through", []timelineStep{
+			same(MaxTimelineTracks, 5, 5, 0), same(ParamSetStreamIndex, 0, 0, 0),
+			restarted(same(MaxTimelineTracks, 0, 0, 0)), same(MaxTimelineTracks+1, -3, -4, key),
+		}},
+		{"an upstream discontinuity is kept", []timelineStep{
+			video(100, 100, key), video(101, 101, 0), video(102, 102, key|disc), video(103, 103, 0),
+		}},
+		{"an upstream discontinuity on a rebased packet", []timelineStep{
+			video(100, 100, key), video(101, 101, 0),
+			restarted(video(0, 102, key|disc)),
+		}},
+	} {
+		var tl timeline
+		for i, s := range tc.steps {
+			pkt := &Packet{Header: Header{Pts: s.pts, Dts: s.dts, StreamIndex: s.index, Flags: s.flags, Size: 10}, restart: s.restart}
+			pkt.Header.Encode(pkt.Head[:])
+			tl.normalize(pkt)
+
+			want := Header{Pts: s.wantPts, Dts: s.wantDts, StreamIndex: s.index, Flags: s.wantFlags, Size: 10}
+			got := pkt.Header
+			if got != want {
+				t.Errorf("%s, packet %d: got %s, want %s", tc.name, i, formatTimelineHeader(got), formatTimelineHeader(want))
+			}
+			if DecodeHeader(pkt.Head[:]) != got {
+				t.Errorf("%s, packet %d: Head %+v does not match Header %+v", tc.name, i, DecodeHeader(pkt.Head[:]), got)
+			}
+		}
+	}
+}
+
+func formatTimelineHeader(h Header) string {
+	return fmt.Sprintf("stream %d pts %d dts %d flags %#x", h.StreamIndex, h.Pts, h.Dts, h.Flags)
+}